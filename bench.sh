@@ -0,0 +1,364 @@
+#!/bin/bash
+#
+# Throughput benchmarks against a mounted nufs instance.
+#
+# Usage: ./bench.sh [section...]
+#        ./bench.sh matrix [section...]
+#
+# The image must be large enough for the data set (e.g. ./mkfs.nufs -s 4G data.nufs) and mounted
+# at MNT_ROOT (make mount) before running. With no arguments every section is run. The matrix mode
+# instead formats and mounts its own MATRIX_SIZE (default 4G) image at every block size in turn.
+
+MNT_ROOT="${MNT_ROOT:-mnt}";
+BENCH_DIR="${MNT_ROOT}/bench";
+
+# Print the elapsed seconds since the given start time.
+elapsed() {
+    echo "$(date +%s.%N) - $1" | bc;
+}
+
+# Print a throughput figure in MB/s for the given size in MB and elapsed seconds.
+mbps() {
+    echo "scale=1; $1 / $2" | bc;
+}
+
+# Sequential write then read of single files from 1MB up to 1GB.
+bench_seq() {
+    printf "Sequential throughput\n";
+    printf "=====================\n";
+    printf "%8s %12s %12s\n" "size" "write MB/s" "read MB/s";
+
+    for mb in 1 4 16 64 256 1024
+    do
+        local file="${BENCH_DIR}/seq_${mb}M";
+
+        local start=$(date +%s.%N);
+        dd if=/dev/zero of="${file}" bs=128K count=$((mb * 8)) status=none;
+        local write_time=$(elapsed ${start});
+
+        start=$(date +%s.%N);
+        dd if="${file}" of=/dev/null bs=128K status=none;
+        local read_time=$(elapsed ${start});
+
+        printf "%7dM %12s %12s\n" ${mb} $(mbps ${mb} ${write_time}) $(mbps ${mb} ${read_time});
+        rm -f "${file}";
+    done;
+}
+
+# Repeated getattr over a tree of small files, like ls -l or make walking a source tree.
+bench_stat() {
+    printf "Stat storm\n";
+    printf "==========\n";
+    printf "%8s %8s %12s\n" "files" "passes" "stats/s";
+
+    local dir="${BENCH_DIR}/stat";
+    local files=2000;
+    local passes=20;
+
+    for d in $(seq 0 19)
+    do
+        mkdir -p "${dir}/d${d}";
+        (cd "${dir}/d${d}" && touch $(seq -f "f%g" 0 $((files / 20 - 1))));
+    done;
+
+    # find -printf with a size and mtime stats every entry it visits.
+    local start=$(date +%s.%N);
+
+    for pass in $(seq ${passes})
+    do
+        find "${dir}" -printf "%s %T@\n" > /dev/null;
+    done;
+
+    local stat_time=$(elapsed ${start});
+
+    printf "%8d %8d %12s\n" ${files} ${passes} $(echo "${files} * ${passes} / ${stat_time}" | bc);
+    rm -rf "${dir}";
+}
+
+# Create, write and read back many files of a few hundred bytes.
+bench_small() {
+    printf "Small files\n";
+    printf "===========\n";
+    printf "%8s %8s %14s %10s\n" "files" "bytes" "create+write/s" "read/s";
+
+    local dir="${BENCH_DIR}/small";
+    local files=2000;
+    local data=$(head -c 150 /dev/zero | tr '\0' 'x');
+    mkdir -p "${dir}";
+
+    local start=$(date +%s.%N);
+
+    for i in $(seq ${files})
+    do
+        printf "%s" "${data}" > "${dir}/f${i}";
+    done;
+
+    local write_time=$(elapsed ${start});
+
+    start=$(date +%s.%N);
+    cat "${dir}"/f* > /dev/null;
+    local read_time=$(elapsed ${start});
+
+    printf "%8d %8d %14s %10s\n" ${files} ${#data} $(echo "${files} / ${write_time}" | bc) \
+        $(echo "${files} / ${read_time}" | bc);
+    rm -rf "${dir}";
+}
+
+# Space used by files of 1-3KB, which only need part of their last block.
+bench_tails() {
+    printf "Tail packing\n";
+    printf "============\n";
+    printf "%8s %12s %12s %8s\n" "files" "data KB" "used KB" "ratio";
+
+    local dir="${BENCH_DIR}/tails";
+    local files=2000;
+    mkdir -p "${dir}";
+
+    for i in $(seq ${files})
+    do
+        head -c $((1024 + RANDOM % 2049)) /dev/zero > "${dir}/f${i}";
+    done;
+
+    # du counts the blocks and fragments each file holds, --apparent-size the bytes in it.
+    local data_kb=$(du -sk --apparent-size "${dir}" | cut -f1);
+    local used_kb=$(du -sk "${dir}" | cut -f1);
+
+    printf "%8d %12d %12d %8s\n" ${files} ${data_kb} ${used_kb} \
+        $(echo "scale=2; ${used_kb} / ${data_kb}" | bc);
+    rm -rf "${dir}";
+}
+
+# Extending truncate and a few scattered writes into the resulting hole, like a fresh VM image.
+bench_sparse() {
+    printf "Sparse files\n";
+    printf "============\n";
+    printf "%8s %12s %12s %12s\n" "size" "truncate s" "writes s" "used KB";
+
+    local file="${BENCH_DIR}/sparse";
+
+    local start=$(date +%s.%N);
+    truncate -s 1G "${file}";
+    local truncate_time=$(elapsed ${start});
+
+    start=$(date +%s.%N);
+
+    for mb in 0 100 200 300 400 500 600 700 800 900
+    do
+        dd if=/dev/zero of="${file}" bs=4K count=1 seek=$((mb * 256)) conv=notrunc status=none;
+    done;
+
+    local write_time=$(elapsed ${start});
+
+    printf "%8s %12s %12s %12d\n" 1G ${truncate_time} ${write_time} \
+        $(du -sk "${file}" | cut -f1);
+    rm -f "${file}";
+}
+
+# Repeated stat of files at the bottom of a deep directory tree, where every lookup resolves every
+# component of the path.
+bench_deep() {
+    printf "Deep path stat\n";
+    printf "==============\n";
+    printf "%8s %8s %12s\n" "depth" "stats" "stats/s";
+
+    local dir="${BENCH_DIR}/deep";
+    local depth=16;
+    local stats=20000;
+
+    for level in $(seq ${depth})
+    do
+        dir="${dir}/level${level}";
+    done;
+
+    mkdir -p "${dir}";
+    (cd "${dir}" && touch $(seq -f "f%g" 0 99));
+
+    # xargs hands stat as many paths at a time as fit on a command line.
+    local start=$(date +%s.%N);
+
+    for i in $(seq 0 $((stats - 1)))
+    do
+        echo "${dir}/f$((i % 100))";
+    done | xargs stat -c %s > /dev/null;
+
+    local stat_time=$(elapsed ${start});
+
+    printf "%8d %8d %12s\n" ${depth} ${stats} $(echo "${stats} / ${stat_time}" | bc);
+
+    # Show how many of the lookups the directory entry cache answered, if nufsctl is built.
+    if [ -x ./nufsctl ]
+    then
+        ./nufsctl stats "${MNT_ROOT}";
+    fi;
+
+    rm -rf "${BENCH_DIR}/deep";
+}
+
+# Repeated stat of names that don't exist, like a compiler searching its include path or an
+# interpreter its module path.
+bench_probe() {
+    printf "Missing name probes\n";
+    printf "===================\n";
+    printf "%8s %8s %12s\n" "files" "probes" "probes/s";
+
+    local dir="${BENCH_DIR}/probe";
+    local files=1000;
+    local probes=20000;
+    mkdir -p "${dir}";
+    (cd "${dir}" && touch $(seq -f "f%g" 0 $((files - 1))));
+
+    # Every stat fails, so its complaints are thrown away along with the output.
+    local start=$(date +%s.%N);
+
+    for i in $(seq 0 $((probes - 1)))
+    do
+        echo "${dir}/missing$((i % 100)).h";
+    done | xargs stat -c %s > /dev/null 2>&1;
+
+    local probe_time=$(elapsed ${start});
+
+    printf "%8d %8d %12s\n" ${files} ${probes} $(echo "${probes} / ${probe_time}" | bc);
+    rm -rf "${dir}";
+}
+
+# Repeated long listings of a directory of many files, like ls -l or a file manager opening it.
+bench_list() {
+    printf "Directory listing\n";
+    printf "=================\n";
+    printf "%8s %8s %12s\n" "files" "passes" "entries/s";
+
+    local dir="${BENCH_DIR}/list";
+    local files=10000;
+    local passes=10;
+    mkdir -p "${dir}";
+    (cd "${dir}" && seq -f "f%g" 0 $((files - 1)) | xargs touch);
+
+    local start=$(date +%s.%N);
+
+    for pass in $(seq ${passes})
+    do
+        ls -l "${dir}" > /dev/null;
+    done;
+
+    local list_time=$(elapsed ${start});
+
+    printf "%8d %8d %12s\n" ${files} ${passes} $(echo "${files} * ${passes} / ${list_time}" | bc);
+    rm -rf "${dir}";
+}
+
+# Repeated stat of the same files and repeated reads of the same file, which the kernel can answer
+# from its own caches when the image is mounted with them enabled (make mount-cached).
+bench_cache() {
+    printf "Kernel caching\n";
+    printf "==============\n";
+    printf "%8s %8s %12s %8s %8s %12s\n" "files" "passes" "stats/s" "size" "reads" "read MB/s";
+
+    local dir="${BENCH_DIR}/cache";
+    local files=1000;
+    local passes=20;
+    local mb=64;
+    local reads=5;
+    mkdir -p "${dir}";
+    (cd "${dir}" && touch $(seq -f "f%g" 0 $((files - 1))));
+
+    local start=$(date +%s.%N);
+
+    for pass in $(seq ${passes})
+    do
+        find "${dir}" -printf "%s %T@\n" > /dev/null;
+    done;
+
+    local stat_time=$(elapsed ${start});
+
+    # Without kernel_cache the page cache is dropped every time the file is opened, so every read
+    # goes back to nufs.
+    local file="${dir}/data";
+    dd if=/dev/zero of="${file}" bs=128K count=$((mb * 8)) status=none;
+
+    start=$(date +%s.%N);
+
+    for pass in $(seq ${reads})
+    do
+        dd if="${file}" of=/dev/null bs=128K status=none;
+    done;
+
+    local read_time=$(elapsed ${start});
+
+    printf "%8d %8d %12s %7dM %8d %12s\n" ${files} ${passes} \
+        $(echo "${files} * ${passes} / ${stat_time}" | bc) ${mb} ${reads} \
+        $(mbps $((mb * reads)) ${read_time});
+    rm -rf "${dir}";
+}
+
+# Total size and file count of a large tree, taken by walking it with du and by asking nufs for
+# the totals it keeps in the directory headers.
+bench_usage() {
+    printf "Tree usage\n";
+    printf "==========\n";
+    printf "%8s %8s %12s %12s\n" "files" "dirs" "du -s s" "usage s";
+
+    local dir="${BENCH_DIR}/usage";
+    local dirs=100;
+    local files=20000;
+
+    for d in $(seq 0 $((dirs - 1)))
+    do
+        mkdir -p "${dir}/d${d}";
+        (cd "${dir}/d${d}" && seq -f "f%g" 0 $((files / dirs - 1)) | xargs touch);
+    done;
+
+    local start=$(date +%s.%N);
+    du -s --apparent-size "${dir}" > /dev/null;
+    local du_time=$(elapsed ${start});
+
+    local usage_time="-";
+
+    if [ -x ./nufsctl ]
+    then
+        start=$(date +%s.%N);
+        ./nufsctl usage "${dir}" > /dev/null;
+        usage_time=$(elapsed ${start});
+    fi;
+
+    printf "%8d %8d %12s %12s\n" ${files} ${dirs} ${du_time} ${usage_time};
+    rm -rf "${dir}";
+}
+
+# Run the given sections against the image mounted at MNT_ROOT.
+bench_run() {
+    mkdir -p "${BENCH_DIR}";
+
+    for section in "$@"
+    do
+        bench_${section};
+    done;
+
+    rm -rf "${BENCH_DIR}";
+}
+
+# Format, mount and run the given sections once per block size. Needs nufs and mkfs.nufs built and
+# nothing mounted at MNT_ROOT yet. NUFS_OPTS is passed on to nufs, e.g. the CACHE_OPTS of the
+# Makefile.
+bench_matrix() {
+    local image="bench.nufs";
+    mkdir -p "${MNT_ROOT}";
+
+    for bs in 1K 4K 64K
+    do
+        printf "\n### %s blocks\n\n" ${bs};
+        ./mkfs.nufs -s "${MATRIX_SIZE:-4G}" -b ${bs} "${image}" > /dev/null || return 1;
+        ./nufs -s ${NUFS_OPTS} "${MNT_ROOT}" "${image}" > /dev/null || return 1;
+        bench_run "$@";
+        fusermount -u "${MNT_ROOT}";
+    done;
+
+    rm -f "${image}";
+}
+
+if [ "$1" = "matrix" ]
+then
+    shift;
+    bench_matrix ${@:-seq stat small tails sparse deep probe list cache usage};
+else
+    bench_run ${@:-seq stat small tails sparse deep probe list cache usage};
+fi;
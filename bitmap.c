@@ -39,6 +39,36 @@ void bitmap_put(void *bm, int i, int v)
   }
 }
 
+// Find the first zero bit at or after start, scanning a 64-bit word at a time. Bitmaps are stored
+// little endian, so bit i of the bitmap is bit i % 64 of word i / 64.
+int bitmap_find_zero(void *bm, int start, int size)
+{
+  uint64_t *words = (uint64_t *) bm;
+
+  if (start >= size)
+  {
+    return -1;
+  }
+
+  // Treat the bits before the start as used.
+  int word_index = start / 64;
+  uint64_t word = words[word_index] | ((1ull << (start % 64)) - 1);
+
+  while (word == UINT64_MAX)
+  {
+    if (++word_index * 64 >= size)
+    {
+      return -1;
+    }
+
+    word = words[word_index];
+  }
+
+  // The lowest clear bit of the word is the answer, as long as it is still inside the bitmap.
+  int i = word_index * 64 + __builtin_ctzll(~word);
+  return i < size ? i : -1;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size)
 {
@@ -26,6 +26,20 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first zero bit at or after the given index.
+ *
+ * The bitmap is scanned a whole 64-bit word at a time, so it must be 8-byte aligned and its storage
+ * must be padded out to a multiple of 64 bits.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Bit index to start searching from.
+ * @param size The number of bits in the bitmap.
+ *
+ * @return The index of the first zero bit, or -1 if every bit from start onwards is set.
+ */
+int bitmap_find_zero(void *bm, int start, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
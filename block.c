@@ -25,118 +25,668 @@
 
 #define BLOCK_PRINT_COLS 32
 
+// Address space reserved for the image mapping. The image is mapped at the front of the range, so
+// growing it online only maps more of the range and every pointer into the image stays valid.
+#define BLOCK_MAP_RESERVE ((size_t) 1 << 40)
+
+int block_shift = 0;
+
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static size_t blocks_size = 0;
+static size_t blocks_reserved = 0;
+static superblock_t *sbp = 0;
+
+// Lowest block number that might still be free. Everything below it is known to be allocated, so
+// allocation can start here instead of rescanning the front of the bitmap every time.
+static int alloc_hint = 0;
+
+// For every length, the block most recently seen with a free run of fragments of that length, or
+// -1. Entries can go stale, so they are checked against the fragment map before being used.
+static int frag_hints[BLOCK_FRAGS];
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes)
+int bytes_to_blocks(off_t bytes)
+{
+  return (bytes + BLOCK_MASK) >> BLOCK_SHIFT;
+}
+
+// Mark the given run of blocks as occupied.
+void block_reserve(int bnum, int count)
+{
+  void *bbm = block_block_bitmap_start();
+
+  for (int i = 0; i < count; i++)
+  {
+    bitmap_put(bbm, bnum + i, 1);
+  }
+}
+
+// Mark every metadata block (superblock, bitmaps and group descriptors) as occupied.
+void block_reserve_metadata(void)
+{
+  block_reserve(0, sbp->content_bnum);
+
+  // Growing the image may have moved regions out into the data area.
+  block_reserve(sbp->block_bitmap_bnum, sbp->block_bitmap_blocks);
+  block_reserve(sbp->fragmap_bnum, sbp->fragmap_blocks);
+  block_reserve(sbp->gdt_bnum, sbp->gdt_blocks);
+
+  alloc_hint = sbp->content_bnum;
+}
+
+// Map the open image from the end of the current mapping up to the given size.
+int block_map_extend(size_t size)
+{
+  assert(size >= blocks_size && size <= blocks_reserved);
+
+  // Mappings have to start on a page boundary, so the last partial page mapped so far is mapped
+  // again. Both mappings share the same page of the file.
+  size_t start = blocks_size & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+  void *p = mmap(blocks_base + start, size - start, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 blocks_fd, start);
+
+  if (p == MAP_FAILED)
+  {
+    return -errno;
+  }
+
+  blocks_size = size;
+  return 0;
+}
+
+// Map the first size bytes of the open image into memory.
+void block_map(size_t size)
+{
+  // Reserve the address space first and then map the image over the front of it.
+  blocks_reserved = MAX(size, BLOCK_MAP_RESERVE);
+  blocks_base = mmap(0, blocks_reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+  assert(blocks_base != MAP_FAILED);
+
+  blocks_size = 0;
+  int rv = block_map_extend(size);
+  assert(rv == 0);
+
+  sbp = block_get(SUPERBLOCK_BNUM);
+}
+
+// Get log2 of the given block size, or -1 if it isn't a supported power of two.
+int block_size_shift(int block_size)
 {
-  return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (int shift = 0; (1 << shift) <= MAX_BLOCK_SIZE; shift++)
+  {
+    if ((1 << shift) == block_size)
+    {
+      return block_size >= MIN_BLOCK_SIZE ? shift : -1;
+    }
+  }
+
+  return -1;
 }
 
-// Load and initialize the given disk image.
-void block_init(const char *image_path)
+// Write a fresh superblock and empty metadata regions to the given image.
+int block_format(const char *image_path, int block_count, int block_size, size_t gdt_size)
+{
+  assert(image_path);
+  assert(gdt_size > 0);
+
+  int shift = block_size_shift(block_size);
+
+  if (block_count < MIN_BLOCK_COUNT || shift < 0)
+  {
+    return -EINVAL;
+  }
+
+  // Everything below is measured in blocks of the new size.
+  block_shift = shift;
+
+  // Lay out the metadata regions back to back directly after the superblock.
+  superblock_t sb;
+  memset(&sb, 0, sizeof(superblock_t));
+  sb.magic = NUFS_MAGIC;
+  sb.version = NUFS_VERSION;
+  sb.block_size = BLOCK_SIZE;
+  sb.block_count = block_count;
+  sb.block_bitmap_bnum = SUPERBLOCK_BNUM + 1;
+  sb.block_bitmap_blocks = bytes_to_blocks((block_count + 7) / 8);
+  sb.fragmap_bnum = sb.block_bitmap_bnum + sb.block_bitmap_blocks;
+  sb.fragmap_blocks = bytes_to_blocks(block_count);
+  sb.gdt_bnum = sb.fragmap_bnum + sb.fragmap_blocks;
+  sb.gdt_blocks = bytes_to_blocks(gdt_size);
+  sb.content_bnum = sb.gdt_bnum + sb.gdt_blocks;
+
+  // Ensure at least one data block remains once the metadata is accounted for.
+  if (sb.content_bnum >= block_count)
+  {
+    return -ENOSPC;
+  }
+
+  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
+
+  if (blocks_fd < 0)
+  {
+    return -errno;
+  }
+
+  // Truncating to zero first discards any old contents so that every region starts out zeroed
+  // without having to write the (possibly multi-GB) image.
+  if (ftruncate(blocks_fd, 0) < 0 || ftruncate(blocks_fd, (off_t) block_count << BLOCK_SHIFT) < 0)
+  {
+    int rv = -errno;
+    close(blocks_fd);
+    blocks_fd = -1;
+    return rv;
+  }
+
+  // Map just the metadata, write the superblock and reserve the metadata blocks.
+  block_map((size_t) sb.content_bnum << BLOCK_SHIFT);
+  memcpy(sbp, &sb, sizeof(superblock_t));
+  block_reserve_metadata();
+
+  block_deinit();
+  return 0;
+}
+
+// Load the given disk image, reading its geometry from the superblock.
+int block_init(const char *image_path)
 {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  // An empty image has never been formatted.
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+  if (st.st_size == 0)
+  {
+    close(blocks_fd);
+    blocks_fd = -1;
+    return -ENODATA;
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = block_block_bitmap_start();
+  // Read the superblock and ensure it describes an image this build understands.
+  superblock_t sb;
+
+  if (pread(blocks_fd, &sb, sizeof(superblock_t), 0) != sizeof(superblock_t)
+      || sb.magic != NUFS_MAGIC || sb.version < NUFS_OLDEST_VERSION || sb.version > NUFS_VERSION
+      || block_size_shift(sb.block_size) < 0
+      || (off_t) sb.block_count * sb.block_size > st.st_size)
+  {
+    close(blocks_fd);
+    blocks_fd = -1;
+    return -EINVAL;
+  }
 
-  // Mark both blocks as occupied
-  bitmap_put(bbm, 0, 1);
-  bitmap_put(bbm, 1, 1);
+  // Map the whole image to memory.
+  block_shift = block_size_shift(sb.block_size);
+  block_map((size_t) sb.block_count << BLOCK_SHIFT);
+  alloc_hint = sbp->content_bnum;
+  memset(frag_hints, -1, sizeof(frag_hints));
+
+  return 0;
 }
 
 // Close the disk image.
 void block_deinit(void)
 {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  int rv = munmap(blocks_base, blocks_reserved);
   assert(rv == 0);
+
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_base = 0;
+  blocks_size = 0;
+  blocks_reserved = 0;
+  sbp = 0;
+}
+
+// Write every dirty block of the image back to the image file.
+int block_sync(void)
+{
+  if (msync(blocks_base, blocks_size, MS_SYNC) < 0)
+  {
+    return -errno;
+  }
+
+  return 0;
 }
 
 void block_clear(void)
 {
-  // Memory clear everything.
-  memset(blocks_base, 0, NUFS_SIZE);
+  // Memory clear every metadata region but leave the superblock in place. Data blocks don't need
+  // to be touched since nothing references them once the bitmaps are empty.
+  memset(block_block_bitmap_start(), 0, (size_t) sbp->block_bitmap_blocks << BLOCK_SHIFT);
+  memset(block_get(sbp->fragmap_bnum), 0, (size_t) sbp->fragmap_blocks << BLOCK_SHIFT);
+  memset(block_gdt_start(), 0, (size_t) sbp->gdt_blocks << BLOCK_SHIFT);
+
+  // The inode groups lived in data blocks, so they are gone too.
+  sbp->inode_count = 0;
+  sbp->inode_group_count = 0;
+  memset(frag_hints, -1, sizeof(frag_hints));
+
+  // Mark the metadata blocks as occupied.
+  block_reserve_metadata();
+}
 
-  // block 0 stores the block bitmap and the inode bitmap
+// Move a metadata region to *nextp if it is smaller than the given number of blocks, advancing
+// *nextp past it.
+void block_move_region(int *bnump, int *blocksp, int blocks, int *nextp)
+{
+  if (*blocksp >= blocks)
+  {
+    return;
+  }
+
+  int old_bnum = *bnump;
+  int old_blocks = *blocksp;
+
+  // The new space is still zeroed, so only the old contents have to be copied.
+  memcpy(block_get(*nextp), block_get(old_bnum), (size_t) old_blocks << BLOCK_SHIFT);
+  *bnump = *nextp;
+  *blocksp = blocks;
+  *nextp += blocks;
+
+  // A region that was moved by an earlier grow already lives in the data area, so its old copy
+  // can be given back. The original copy stays reserved in front of the data area.
+  if (old_bnum >= sbp->content_bnum)
+  {
+    for (int i = 0; i < old_blocks; i++)
+    {
+      block_free(old_bnum + i);
+    }
+  }
+}
+
+// Grow the loaded image to the given number of blocks while it stays in use.
+int block_grow(int block_count, size_t gdt_size)
+{
+  int old_count = sbp->block_count;
+  size_t size = (size_t) block_count << BLOCK_SHIFT;
+
+  if (block_count <= old_count)
+  {
+    return -EINVAL;
+  }
+
+  if (size > blocks_reserved)
+  {
+    return -EFBIG;
+  }
+
+  // Work out which regions have to move and ensure they fit in the new space with room to spare.
+  int bitmap_blocks = bytes_to_blocks((block_count + 7) / 8);
+  int fragmap_blocks = bytes_to_blocks(block_count);
+  int gdt_blocks = bytes_to_blocks(gdt_size);
+  int moved_blocks = (sbp->block_bitmap_blocks < bitmap_blocks ? bitmap_blocks : 0)
+                     + (sbp->fragmap_blocks < fragmap_blocks ? fragmap_blocks : 0)
+                     + (sbp->gdt_blocks < gdt_blocks ? gdt_blocks : 0);
+
+  if (old_count + moved_blocks >= block_count)
+  {
+    return -ENOSPC;
+  }
+
+  // Extend the image file and map the new blocks after the old ones.
+  if (ftruncate(blocks_fd, (off_t) size) < 0)
+  {
+    return -errno;
+  }
+
+  int rv = block_map_extend(size);
+
+  // Give the new space back. If even that fails the file stays larger than the image says, which
+  // only wastes space, but it has to be reported since the grow itself fails either way.
+  if (rv < 0)
+  {
+    if (ftruncate(blocks_fd, (off_t) old_count << BLOCK_SHIFT) < 0)
+    {
+      fprintf(stderr, "nufs: cannot shrink the image back to %d blocks: %s\n", old_count,
+              strerror(errno));
+    }
+
+    return rv;
+  }
+
+  // Regions that are too small for the new size move to the start of the new space. Copies left in
+  // front of the data area by the format stay reserved, while copies in the data area from an
+  // earlier grow are freed.
+  int next_bnum = old_count;
+  block_move_region(&sbp->block_bitmap_bnum, &sbp->block_bitmap_blocks, bitmap_blocks, &next_bnum);
+  block_move_region(&sbp->fragmap_bnum, &sbp->fragmap_blocks, fragmap_blocks, &next_bnum);
+  block_move_region(&sbp->gdt_bnum, &sbp->gdt_blocks, gdt_blocks, &next_bnum);
+  block_reserve(old_count, next_bnum - old_count);
+
+  // Only now are the new blocks covered by the bitmap and can be allocated.
+  sbp->block_count = block_count;
+  alloc_hint = MIN(alloc_hint, next_bnum);
+
+  printf("block_grow(%d) -> %d moved\n", block_count, next_bnum - old_count);
+
+  return 0;
+}
+
+// Get a pointer to the superblock of the loaded image.
+superblock_t *block_superblock(void)
+{
+  return sbp;
+}
+
+// Get the total number of blocks in the loaded image.
+int block_total_count(void)
+{
+  return sbp->block_count;
+}
+
+// Count the free blocks of the loaded image. Only the data area can have any.
+int block_free_count(void)
+{
   void *bbm = block_block_bitmap_start();
+  int count = 0;
+
+  for (int bnum = sbp->content_bnum; bnum < sbp->block_count; bnum++)
+  {
+    count += !bitmap_get(bbm, bnum);
+  }
+
+  return count;
+}
 
-  // Mark both blocks as occupied
-  bitmap_put(bbm, 0, 1);
-  bitmap_put(bbm, 1, 1);
+// Get the total number of inodes in the loaded image.
+int block_inode_count(void)
+{
+  return sbp->inode_count;
 }
 
 // Get the given block, returning a pointer to its start.
 void *block_get(int bnum)
 {
-  return blocks_base + (BLOCK_SIZE * bnum);
+  return blocks_base + ((size_t) bnum << BLOCK_SHIFT);
 }
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
+// The size is block_bitmap_blocks blocks.
 void *block_block_bitmap_start(void)
 {
-  return block_get(0);
+  return block_get(sbp->block_bitmap_bnum);
 }
 
-// Return a pointer to the beginning of the inode table bitmap.
-void *block_inode_bitmap_start(void)
+// Return a pointer to the beginning of the inode group descriptor table.
+void *block_gdt_start(void)
 {
-  // The inode bitmap is stored immediately after the block bitmap
-  return block_block_bitmap_start() + BLOCK_BITMAP_SIZE;
-}
-
-void *block_inode_start(void)
-{
-  return block_inode_bitmap_start() + INODE_BITMAP_SIZE;
+  return block_get(sbp->gdt_bnum);
 }
 
 void *block_content_start(void)
 {
-  return block_get(0) + RESERVED_SIZE;
+  return block_get(sbp->content_bnum);
 }
 
 // Allocate a new block and return its index.
 int block_alloc(void)
+{
+  int bnum = bitmap_find_zero(block_block_bitmap_start(), alloc_hint, sbp->block_count);
+
+  if (bnum < 0)
+  {
+    // Everything from the hint onwards is in use so there is no reason to keep scanning from it.
+    alloc_hint = sbp->block_count;
+
+    return -ENOSPC;
+  }
+
+  bitmap_put(block_block_bitmap_start(), bnum, 1);
+  alloc_hint = bnum + 1;
+
+  printf("block_alloc() -> %d\n", bnum);
+
+  return bnum;
+}
+
+// Allocate the block with the given index if it is free, otherwise fall back to any free block.
+int block_alloc_near(int goal)
 {
   void *bbm = block_block_bitmap_start();
 
-  for (int ii = RESERVED_BLOCKS; ii < BLOCK_COUNT; ++ii)
+  if (goal >= sbp->content_bnum && goal < sbp->block_count && !bitmap_get(bbm, goal))
   {
-    if (!bitmap_get(bbm, ii))
+    bitmap_put(bbm, goal, 1);
+
+    // The hint only has to move if the goal was the lowest free block.
+    if (goal == alloc_hint)
     {
-      bitmap_put(bbm, ii, 1);
+      alloc_hint++;
+    }
 
-      printf("block_alloc() -> %d\n", ii);
-      block_print_bitmap();
+    printf("block_alloc_near(%d) -> %d\n", goal, goal);
 
-      return ii;
-    }
+    return goal;
   }
 
-  block_print_bitmap();
+  return block_alloc();
+}
+
+// Allocate a run of contiguous blocks and return the index of the first one.
+int block_alloc_run(int count)
+{
+  assert(count > 0);
+
+  void *bbm = block_block_bitmap_start();
+  int start = alloc_hint;
+
+  // Try every free block from the hint onwards as the start of the run.
+  while ((start = bitmap_find_zero(bbm, start, sbp->block_count)) >= 0)
+  {
+    int length = 1;
+
+    while (length < count && start + length < sbp->block_count
+           && !bitmap_get(bbm, start + length))
+    {
+      length++;
+    }
+
+    if (length == count)
+    {
+      for (int bnum = start; bnum < start + count; bnum++)
+      {
+        bitmap_put(bbm, bnum, 1);
+      }
+
+      // The hint only has to move if the run started at the lowest free block.
+      if (start == alloc_hint)
+      {
+        alloc_hint += count;
+      }
+
+      printf("block_alloc_run(%d) -> %d\n", count, start);
+
+      return start;
+    }
+
+    // The run was too short, so skip past it.
+    start += length;
+  }
 
   return -ENOSPC;
 }
 
+// Allocate the run of blocks starting at the given index if they are all free, otherwise fall back
+// to any run that is long enough.
+int block_alloc_run_near(int goal, int count)
+{
+  assert(count > 0);
+
+  void *bbm = block_block_bitmap_start();
+
+  if (goal < sbp->content_bnum || goal > sbp->block_count - count)
+  {
+    return block_alloc_run(count);
+  }
+
+  for (int bnum = goal; bnum < goal + count; bnum++)
+  {
+    if (bitmap_get(bbm, bnum))
+    {
+      return block_alloc_run(count);
+    }
+  }
+
+  for (int bnum = goal; bnum < goal + count; bnum++)
+  {
+    bitmap_put(bbm, bnum, 1);
+  }
+
+  // The hint only has to move if the goal was the lowest free block.
+  if (goal == alloc_hint)
+  {
+    alloc_hint += count;
+  }
+
+  printf("block_alloc_run_near(%d, %d) -> %d\n", goal, count, goal);
+
+  return goal;
+}
+
+// Get the fragment map entry of the given block.
+byte_t *block_fragmap(int bnum)
+{
+  return (byte_t *) block_get(sbp->fragmap_bnum) + bnum;
+}
+
+// Find the first run of count free fragments in the given fragment map entry, or -1 if none.
+int block_frag_run(byte_t map, int count)
+{
+  int mask = (1 << count) - 1;
+
+  for (int frag = 0; frag + count <= BLOCK_FRAGS; frag++)
+  {
+    if (!(map & (mask << frag)))
+    {
+      return frag;
+    }
+  }
+
+  return -1;
+}
+
+// Get the length of the longest run of free fragments in the given fragment map entry.
+int block_frag_longest(byte_t map)
+{
+  int longest = 0;
+  int run = 0;
+
+  for (int frag = 0; frag < BLOCK_FRAGS; frag++)
+  {
+    run = (map & (1 << frag)) ? 0 : run + 1;
+    longest = MAX(longest, run);
+  }
+
+  return longest;
+}
+
+// Remember the given fragment block under the length of its longest free run.
+void block_frag_hint(int bnum)
+{
+  int longest = block_frag_longest(*block_fragmap(bnum));
+
+  if (longest > 0)
+  {
+    frag_hints[longest] = bnum;
+  }
+}
+
+// Allocate a run of contiguous fragments within a single block.
+int block_alloc_frags(int count, int *fragp)
+{
+  assert(count > 0 && count < BLOCK_FRAGS);
+  assert(fragp);
+
+  int bnum = -1;
+  int frag = -1;
+
+  // Take the smallest free run that fits so the longer runs stay available for longer tails. A
+  // hinted block with an empty map has been freed (or reused as a whole block) in the meantime.
+  for (int length = count; length < BLOCK_FRAGS && frag < 0; length++)
+  {
+    int hint = frag_hints[length];
+
+    if (hint >= 0 && *block_fragmap(hint) != 0)
+    {
+      bnum = hint;
+      frag = block_frag_run(*block_fragmap(hint), count);
+    }
+  }
+
+  // Split up a fresh block if none of the hinted ones has room.
+  if (frag < 0)
+  {
+    if ((bnum = block_alloc()) < 0)
+    {
+      return bnum;
+    }
+
+    frag = 0;
+  }
+
+  *block_fragmap(bnum) |= ((1 << count) - 1) << frag;
+  *fragp = frag;
+  block_frag_hint(bnum);
+
+  printf("block_alloc_frags(%d) -> %d:%d\n", count, bnum, frag);
+
+  return bnum;
+}
+
+// Grow a run of fragments in place if the fragments after it are free.
+int block_extend_frags(int bnum, int frag, int count, int new_count)
+{
+  assert(count > 0 && new_count >= count && frag + new_count <= BLOCK_FRAGS);
+
+  int mask = ((1 << (new_count - count)) - 1) << (frag + count);
+
+  if (*block_fragmap(bnum) & mask)
+  {
+    return -ENOSPC;
+  }
+
+  *block_fragmap(bnum) |= mask;
+  return 0;
+}
+
+// Deallocate a run of fragments, freeing the block once all of its fragments are free.
+void block_free_frags(int bnum, int frag, int count)
+{
+  assert(count > 0 && frag + count <= BLOCK_FRAGS);
+
+  byte_t *mapp = block_fragmap(bnum);
+  *mapp &= ~(((1 << count) - 1) << frag);
+
+  printf("block_free_frags(%d:%d, %d)\n", bnum, frag, count);
+
+  if (*mapp == 0)
+  {
+    block_free(bnum);
+    return;
+  }
+
+  // Room just opened up in this block, so fill it before splitting up another one.
+  block_frag_hint(bnum);
+}
+
 // Deallocate the block with the given index.
 void block_free(int bnum)
 {
+  assert(bnum >= sbp->content_bnum);
+  assert(bnum < sbp->block_count);
+
   void *bbm = block_block_bitmap_start();
   bitmap_put(bbm, bnum, 0);
+
+  // Keep the hint at the lowest free block so allocation stays first-fit.
+  alloc_hint = MIN(alloc_hint, bnum);
+
   printf("block_free(%d)\n", bnum);
-  block_print_bitmap();
 }
 
 void block_print(int bnum)
@@ -178,5 +728,5 @@ void block_print(int bnum)
 void block_print_bitmap(void)
 {
   // Display the allocation bitmap.
-  bitmap_print(block_block_bitmap_start(), BLOCK_COUNT);
+  bitmap_print(block_block_bitmap_start(), sbp->block_count);
 }
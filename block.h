@@ -4,28 +4,120 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The disk image is mmapped, so block data is accessed using pointers. The first block of every
+ * image holds a superblock describing the geometry of the image, so nothing about the image size is
+ * fixed at compile time.
  */
 #ifndef _BLOCK_H
 #define _BLOCK_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
-/** 
+/**
+ * log2 of the block size of the loaded image.
+ *
+ * The block size is picked at format time and read back from the superblock at mount. It is kept in
+ * a plain global rather than behind an accessor, and always a power of two, so that block number
+ * and offset math in the hot paths is a shift and a mask instead of a call and a division.
+ */
+extern int block_shift;
+
+#define BLOCK_SHIFT block_shift
+#define BLOCK_SIZE  (1 << BLOCK_SHIFT)
+#define BLOCK_MASK  (BLOCK_SIZE - 1)
+
+// Blocks can also be split into BLOCK_FRAGS fragments that are allocated individually, so the small
+// final block of a file doesn't have to take up a whole block.
+#define BLOCK_FRAGS 8
+#define FRAG_SHIFT  (BLOCK_SHIFT - 3)
+#define FRAG_SIZE   (1 << FRAG_SHIFT)
+#define FRAG_MASK   (FRAG_SIZE - 1)
+
+/**
+ * The on-disk superblock stored at the start of block SUPERBLOCK_BNUM.
+ *
+ * Every region is described by the number of its first block and its length in blocks. Regions
+ * are laid out back to back in the order they appear here, and every block before content_bnum is
+ * permanently marked as allocated in the block bitmap. Growing the image can move a region that
+ * becomes too small into the new space, where its blocks are marked as allocated as well. The
+ * inode table itself is not a fixed region; each inode group allocates its slice of the table from
+ * the data area when it is added.
+ *
+ * The fragment map holds one byte per block. It is zero for whole blocks and free blocks, and for
+ * a block split into fragments has a bit set for every fragment in use. A fragment block stays
+ * allocated in the block bitmap for as long as any of its fragments are.
+ */
+typedef struct superblock
+{
+  int magic;               // NUFS_MAGIC once the image has been formatted
+  int version;             // on-disk format version
+  int block_size;          // bytes per block
+  int block_count;         // total blocks in the image
+  int inode_size;          // bytes per on-disk inode
+  int inode_count;         // inodes in every group allocated so far
+  int inode_group_size;    // inodes per inode group
+  int inode_group_count;   // inode groups allocated so far
+  int inode_group_max;     // inode groups the group descriptor table has room for
+  int block_bitmap_bnum;   // first block of the free block bitmap
+  int block_bitmap_blocks; // blocks used by the free block bitmap
+  int fragmap_bnum;        // first block of the fragment map
+  int fragmap_blocks;      // blocks used by the fragment map
+  int gdt_bnum;            // first block of the inode group descriptor table
+  int gdt_blocks;          // blocks used by the inode group descriptor table
+  int content_bnum;        // first block available for file and directory data
+  int orphan_inum;         // -1 if none, otherwise the first unlinked inode still open when mounted
+} superblock_t;
+
+/**
  * Compute the number of blocks needed to store the given number of bytes.
  *
  * @param bytes Size of data to store in bytes.
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(off_t bytes);
+
+/**
+ * Write a fresh superblock, an empty block bitmap, fragment map and group descriptor table to the
+ * given disk image, resizing it to fit. The inode fields of the superblock are left zeroed for the
+ * inode layer to fill in.
+ *
+ * @param image_path Path to the disk image file (created if it does not exist).
+ * @param block_count Total number of blocks the image should hold.
+ * @param block_size Bytes per block, a power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE.
+ * @param gdt_size Number of bytes to reserve for the inode group descriptor table.
+ *
+ * @return 0 on success, otherwise a negative error code.
+ */
+int block_format(const char *image_path, int block_count, int block_size, size_t gdt_size);
 
 /**
- * Load and initialize the given disk image.
+ * Load the given disk image, reading its geometry from the superblock.
+ *
+ * Images written by an older (but still supported) format version are loaded as is; upgrading them
+ * is up to the caller.
  *
  * @param image_path Path to the disk image file.
+ *
+ * @return 0 on success, -ENODATA if the image is empty and still needs to be formatted, or -EINVAL
+ *         if the image does not hold a superblock this build understands.
+ */
+int block_init(const char *image_path);
+
+/**
+ * Grow the loaded image to the given number of blocks while it stays mounted.
+ *
+ * The image file is extended and the new blocks are mapped right after the old ones, so pointers
+ * into the image stay valid. The bitmaps and the group descriptor table move into the new space if
+ * they are too small to cover it. The new blocks can be allocated as soon as this returns.
+ *
+ * @param block_count New total number of blocks, larger than the current count.
+ * @param gdt_size Number of bytes the inode group descriptor table needs for the new size.
+ *
+ * @return 0 on success, otherwise a negative error code.
  */
-void block_init(const char *image_path);
+int block_grow(int block_count, size_t gdt_size);
 
 /**
  * Close the disk image.
@@ -33,10 +125,47 @@ void block_init(const char *image_path);
 void block_deinit(void);
 
 /**
- * Clears all blocks but still keeps the first RESERVED_BLOCKS blocks reserved.
+ * Write every block of the loaded image that was changed through the memory map back to the image
+ * file, waiting until it is done.
+ *
+ * @return 0 on success, otherwise a negative error code.
+ */
+int block_sync(void);
+
+/**
+ * Clears all metadata regions but keeps the superblock and the reserved blocks intact.
  */
 void block_clear(void);
 
+/**
+ * Get a pointer to the superblock of the loaded image.
+ *
+ * @return Pointer to the in-memory (mapped) superblock.
+ */
+superblock_t *block_superblock(void);
+
+/**
+ * Get the total number of blocks in the loaded image.
+ *
+ * @return The block count recorded in the superblock.
+ */
+int block_total_count(void);
+
+/**
+ * Count the blocks of the loaded image that aren't in use. A block split into fragments counts as
+ * in use while any of its fragments are.
+ *
+ * @return The number of free blocks.
+ */
+int block_free_count(void);
+
+/**
+ * Get the number of inodes in the inode groups allocated so far.
+ *
+ * @return The inode count recorded in the superblock.
+ */
+int block_inode_count(void);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -54,13 +183,11 @@ void *block_get(int bnum);
 void *block_block_bitmap_start(void);
 
 /**
- * Return a pointer to the beginning of the inode table bitmap.
+ * Return a pointer to the beginning of the inode group descriptor table.
  *
- * @return A pointer to the beginning of the free inode bitmap.
+ * @return A pointer to the first group descriptor.
  */
-void *block_inode_bitmap_start(void);
-
-void *block_inode_start(void);
+void *block_gdt_start(void);
 
 void *block_content_start(void);
 
@@ -73,6 +200,74 @@ void *block_content_start(void);
  */
 int block_alloc(void);
 
+/**
+ * Allocate a block as close to the given goal as possible and return its number.
+ *
+ * Takes the goal block itself if it is unused, which keeps consecutive blocks of a file contiguous
+ * on disk, and otherwise behaves like block_alloc().
+ *
+ * @param goal The preferred block number.
+ *
+ * @return The index of the newly allocated block.
+ */
+int block_alloc_near(int goal);
+
+/**
+ * Allocate a run of contiguous blocks and return the number of the first one.
+ *
+ * @param count Number of blocks in the run.
+ *
+ * @return The index of the first block of the run, or -ENOSPC if no run is long enough.
+ */
+int block_alloc_run(int count);
+
+/**
+ * Allocate a run of contiguous blocks starting as close to the given goal as possible.
+ *
+ * Takes the run starting at the goal itself if every block of it is unused, which lets a file that
+ * keeps growing continue where its last run ended, and otherwise behaves like block_alloc_run().
+ *
+ * @param goal The preferred first block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return The index of the first block of the run, or -ENOSPC if no run is long enough.
+ */
+int block_alloc_run_near(int goal, int count);
+
+/**
+ * Allocate a run of contiguous fragments within a single block.
+ *
+ * The smallest free run known to fit is taken, from blocks that recently had fragments allocated or
+ * freed, and a fresh block is only split up when none of those has room.
+ *
+ * @param count Number of fragments, between 1 and BLOCK_FRAGS - 1.
+ * @param fragp Set to the index of the first fragment of the run within the block.
+ *
+ * @return The number of the block holding the run, or -ENOSPC.
+ */
+int block_alloc_frags(int count, int *fragp);
+
+/**
+ * Grow a run of fragments in place, if the fragments directly after it are free.
+ *
+ * @param bnum The block holding the run.
+ * @param frag Index of the first fragment of the run.
+ * @param count Current number of fragments in the run.
+ * @param new_count Number of fragments the run should have, at most BLOCK_FRAGS - frag.
+ *
+ * @return 0 on success, or -ENOSPC if the following fragments are in use.
+ */
+int block_extend_frags(int bnum, int frag, int count, int new_count);
+
+/**
+ * Deallocate a run of fragments, freeing the whole block once none of its fragments are in use.
+ *
+ * @param bnum The block holding the run.
+ * @param frag Index of the first fragment of the run.
+ * @param count Number of fragments in the run.
+ */
+void block_free_frags(int bnum, int frag, int count);
+
 /**
  * Deallocate the block with the given number.
  *
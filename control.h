@@ -0,0 +1,36 @@
+///
+/// Control commands understood by a mounted nufs instance.
+///
+/// The commands are ioctls that can be issued on any file or directory inside the mount point, see
+/// nufsctl.c.
+///
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Counters reported by NUFS_IOC_STATS, counted since the image was mounted.
+typedef struct nufs_stats
+{
+  uint64_t dcache_hits;          // path components resolved from the directory entry cache
+  uint64_t dcache_negative_hits; // path components the cache knew not to exist
+  uint64_t dcache_misses;        // path components that had to be looked up in their directory
+} nufs_stats_t;
+
+// Totals for the whole tree below a directory reported by NUFS_IOC_USAGE. A file with several hard
+// links counts once, in the directory it was created in or last renamed to.
+typedef struct nufs_usage
+{
+  uint64_t bytes; // bytes in the files and symbolic links
+  uint64_t files; // files and symbolic links
+  uint64_t dirs;  // directories, not counting the one asked about
+} nufs_usage_t;
+
+#define NUFS_IOC_GROW    _IOW('N', 1, uint64_t)     // grow the image to the given size in bytes
+#define NUFS_IOC_STATS   _IOR('N', 2, nufs_stats_t) // read the counters
+#define NUFS_IOC_COMPACT _IOR('N', 3, uint64_t)     // compact the directory, read the blocks freed
+#define NUFS_IOC_USAGE   _IOR('N', 4, nufs_usage_t) // read the totals of the directory's tree
+
+#endif
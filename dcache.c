@@ -0,0 +1,128 @@
+// Directory entry cache.
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include "dcache.h"
+#include "dindex.h"
+
+static dcache_entry_t dcache[DCACHE_SETS][DCACHE_WAYS];
+static dcache_stats_t stats;
+
+// Ticks on every use of an entry, so the least recently used entry of a set has the lowest stamp.
+static unsigned int use_clock = 0;
+
+void dcache_init(void)
+{
+  memset(dcache, 0, sizeof(dcache));
+  memset(&stats, 0, sizeof(stats));
+  use_clock = 0;
+}
+
+// Hash the directory together with the name. Inodes never move while the image is mounted, so the
+// address of the directory inode identifies it just as well as its number.
+unsigned int dcache_hash(const inode_t *dnodep, const char *name)
+{
+  return dindex_hash(name) ^ (unsigned int) ((uintptr_t) dnodep / sizeof(inode_t)) * 2654435761u;
+}
+
+// Find the cached entry for the given name, or NULL if it isn't cached.
+dcache_entry_t *dcache_find(const inode_t *dnodep, const char *name, unsigned int hash)
+{
+  dcache_entry_t *setp = dcache[hash & (DCACHE_SETS - 1)];
+  size_t name_len = strlen(name);
+
+  for (int way = 0; way < DCACHE_WAYS; way++)
+  {
+    dcache_entry_t *entryp = &setp[way];
+
+    if (entryp->dnodep == dnodep && entryp->hash == hash && entryp->name_len == name_len
+        && !memcmp(entryp->name, name, name_len))
+    {
+      return entryp;
+    }
+  }
+
+  return NULL;
+}
+
+int dcache_lookup(const inode_t *dnodep, const char *name)
+{
+  assert(dnodep);
+  assert(name);
+
+  dcache_entry_t *entryp = dcache_find(dnodep, name, dcache_hash(dnodep, name));
+
+  if (!entryp)
+  {
+    stats.misses++;
+    return DCACHE_MISS;
+  }
+
+  if (entryp->inum < 0)
+  {
+    stats.negative_hits++;
+  }
+  else
+  {
+    stats.hits++;
+  }
+
+  entryp->stamp = ++use_clock;
+  return entryp->inum;
+}
+
+void dcache_insert(const inode_t *dnodep, const char *name, int inum)
+{
+  assert(dnodep);
+  assert(name);
+  assert(inum >= 0 || inum == -ENOENT);
+
+  size_t name_len = strlen(name);
+
+  if (name_len >= DCACHE_NAME_LEN)
+  {
+    return;
+  }
+
+  // Reuse the entry if the name is already cached, otherwise replace the least recently used entry
+  // of the set. Unused entries have a stamp of 0 and go first.
+  unsigned int hash = dcache_hash(dnodep, name);
+  dcache_entry_t *entryp = dcache_find(dnodep, name, hash);
+
+  if (!entryp)
+  {
+    dcache_entry_t *setp = dcache[hash & (DCACHE_SETS - 1)];
+    entryp = &setp[0];
+
+    for (int way = 1; way < DCACHE_WAYS; way++)
+    {
+      if (setp[way].stamp < entryp->stamp)
+      {
+        entryp = &setp[way];
+      }
+    }
+  }
+
+  entryp->dnodep = dnodep;
+  entryp->hash = hash;
+  entryp->inum = inum;
+  entryp->stamp = ++use_clock;
+  entryp->name_len = name_len;
+  memcpy(entryp->name, name, name_len + 1);
+}
+
+void dcache_remove(const inode_t *dnodep, const char *name)
+{
+  assert(dnodep);
+  assert(name);
+
+  // The name is known to be missing now, which is worth remembering since files are often looked up
+  // again right after being removed (to be recreated, for example).
+  dcache_insert(dnodep, name, -ENOENT);
+}
+
+dcache_stats_t dcache_get_stats(void)
+{
+  return stats;
+}
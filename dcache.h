@@ -0,0 +1,52 @@
+// Directory entry cache.
+//
+// Resolving a path looks up every component in its parent directory, which means scanning the
+// directory or probing its index on disk. The cache remembers recent lookups in memory, keyed by the
+// directory inode and the name, so resolving the same paths again is a few hash probes per
+// component. It is a plain set-associative table that forgets the least recently used entry of a
+// set when a new one doesn't fit, and it has to be told about every entry that is removed or renamed.
+//
+// Names that were looked up and not found are cached as well, as negative entries, so probing for
+// the same missing names again doesn't search the directory either. Adding an entry replaces the
+// negative entry for its name and removing one leaves a negative entry behind.
+
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <stdint.h>
+#include "util.h"
+#include "inode.h"
+
+// The cache holds DCACHE_SETS * DCACHE_WAYS entries. Names of DCACHE_NAME_LEN bytes or more are
+// never cached, which keeps the entries small and covers nearly every real name.
+#define DCACHE_SETS     1024
+#define DCACHE_WAYS     4
+#define DCACHE_NAME_LEN 40
+
+// Returned by dcache_lookup() if the name is not cached.
+#define DCACHE_MISS -1
+
+typedef struct dcache_entry
+{
+  const inode_t *dnodep;        // directory holding the entry, NULL if the slot is unused
+  unsigned int hash;            // hash of the directory and the name
+  int inum;                     // inode the name refers to, or -ENOENT if there is no such entry
+  unsigned int stamp;           // value of the use clock when the entry was last used
+  unsigned char name_len;       // length of the name, not counting the null terminator
+  char name[DCACHE_NAME_LEN];   // the name itself
+} dcache_entry_t;
+
+typedef struct dcache_stats
+{
+  uint64_t hits;          // lookups answered by the cache with an inode
+  uint64_t negative_hits; // lookups answered by the cache with -ENOENT
+  uint64_t misses;        // lookups that had to go to the directory
+} dcache_stats_t;
+
+void dcache_init(void);
+int dcache_lookup(const inode_t *dnodep, const char *name);
+void dcache_insert(const inode_t *dnodep, const char *name, int inum);
+void dcache_remove(const inode_t *dnodep, const char *name);
+dcache_stats_t dcache_get_stats(void);
+
+#endif
@@ -0,0 +1,274 @@
+// Hashed directory index.
+
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include "specs.h"
+#include "block.h"
+#include "inode.h"
+#include "directory.h"
+#include "dindex.h"
+
+// Smallest table ever built. Tables grow by doubling so they always stay a power of two.
+#define DINDEX_MIN_CAPACITY 256
+
+unsigned int dindex_hash(const char *name)
+{
+  assert(name);
+
+  // 32-bit FNV-1a.
+  unsigned int hash = 2166136261u;
+
+  while (*name)
+  {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+bool_t dindex_exists(inode_t *dnodep)
+{
+  assert(dnodep);
+
+  return inode_get_index(dnodep) >= 0;
+}
+
+dindex_header_t *dindex_header(inode_t *dnodep)
+{
+  assert(dnodep);
+  assert(dindex_exists(dnodep));
+
+  // The header sits at the very start of the first block of the index inode.
+  return block_get(inode_get_bnum(inode_get(inode_get_index(dnodep)), 0));
+}
+
+dindex_slot_t *dindex_slot(inode_t *inodep, int slot_num)
+{
+  assert(inodep);
+  assert(slot_num >= 0);
+
+  // Slots evenly divide the block size, so a slot never straddles two blocks.
+  int offset = sizeof(dindex_header_t) + sizeof(dindex_slot_t) * slot_num;
+  return block_get(inode_get_bnum(inodep, offset >> BLOCK_SHIFT)) + (offset & BLOCK_MASK);
+}
+
+// Put an entry into the first free slot of its probe sequence. The caller must ensure there is room.
+void dindex_place(inode_t *inodep, dindex_header_t *headerp, unsigned int hash, int pos)
+{
+  assert(inodep);
+  assert(headerp);
+
+  int mask = headerp->capacity - 1;
+  dindex_slot_t *slotp;
+
+  for (int slot_num = hash & mask;; slot_num = (slot_num + 1) & mask)
+  {
+    slotp = dindex_slot(inodep, slot_num);
+
+    if (slotp->pos < 0)
+    {
+      // Reusing a tombstone takes it out of the deleted count.
+      if (slotp->pos == DINDEX_DELETED)
+      {
+        headerp->deleted--;
+      }
+
+      slotp->hash = hash;
+      slotp->pos = pos;
+      headerp->used++;
+      return;
+    }
+  }
+}
+
+// Find the slot holding the live entry with the given name, or NULL if there is none.
+dindex_slot_t *dindex_find(inode_t *dnodep, const char *name)
+{
+  assert(dnodep);
+  assert(name);
+
+  inode_t *inodep = inode_get(inode_get_index(dnodep));
+  unsigned int hash = dindex_hash(name);
+  int mask = dindex_header(dnodep)->capacity - 1;
+  dindex_slot_t *slotp;
+
+  // Walk the probe sequence until an empty slot proves the name is absent. Tombstones are skipped
+  // since the entry may have been placed past them.
+  for (int slot_num = hash & mask;; slot_num = (slot_num + 1) & mask)
+  {
+    slotp = dindex_slot(inodep, slot_num);
+
+    if (slotp->pos == DINDEX_EMPTY)
+    {
+      return NULL;
+    }
+
+    if (slotp->pos >= 0 && slotp->hash == hash
+        && !strcmp(directory_get_entry(dnodep, slotp->pos)->name, name))
+    {
+      return slotp;
+    }
+  }
+}
+
+// Mark an inode as holding an index. Without a file type it can't be taken for a user file.
+void dindex_mark(inode_t *inodep)
+{
+  assert(inodep);
+
+  inode_set_mode(inodep, 0);
+  inode_set_flags(inodep, inode_get_flags(inodep) | INODE_FLAG_INTERNAL);
+}
+
+void dindex_mark_all(void)
+{
+  for (int inum = 0; inum < block_inode_count(); inum++)
+  {
+    if (inode_exists(inum) && inode_is_dir(inode_get(inum)) && dindex_exists(inode_get(inum)))
+    {
+      dindex_mark(inode_get(inode_get_index(inode_get(inum))));
+    }
+  }
+}
+
+int dindex_create(inode_t *dnodep)
+{
+  assert(dnodep);
+  assert(!dindex_exists(dnodep));
+
+  // The table lives in its own inode.
+  int inum = inode_alloc();
+
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  inode_add_refs(inode_get(inum), 1);
+  dindex_mark(inode_get(inum));
+  inode_set_index(dnodep, inum);
+
+  // Fill the fresh table with every entry already in the directory.
+  return dindex_rebuild(dnodep, 0);
+}
+
+void dindex_drop(inode_t *dnodep)
+{
+  assert(dnodep);
+  assert(dindex_exists(dnodep));
+
+  // Without an index the directory is simply scanned linearly again.
+  int inum = inode_get_index(dnodep);
+  inode_set_index(dnodep, -1);
+  inode_free(inum);
+}
+
+int dindex_rebuild(inode_t *dnodep, int capacity)
+{
+  assert(dnodep);
+  assert(dindex_exists(dnodep));
+
+  inode_t *inodep = inode_get(inode_get_index(dnodep));
+  int entry_count = directory_populated_entry_count(dnodep);
+
+  // Keep the table at most half full after the rebuild.
+  capacity = MAX(capacity, DINDEX_MIN_CAPACITY);
+
+  while (capacity < entry_count * 2)
+  {
+    capacity *= 2;
+  }
+
+  // Rebuilding doesn't search for free space, so remember how many removals are pending.
+  int holes = inode_total_size(inodep) > 0 ? dindex_header(dnodep)->holes : 0;
+
+  // Resize the index inode to fit the header and the slots.
+  int size = sizeof(dindex_header_t) + sizeof(dindex_slot_t) * capacity;
+  int rv = inode_shrink(inodep, inode_total_size(inodep));
+
+  if (rv >= 0)
+  {
+    rv = inode_grow(inodep, size);
+  }
+
+  // A half built table is useless, so fall back to having no index at all.
+  if (rv < 0)
+  {
+    dindex_drop(dnodep);
+    return rv;
+  }
+
+  // Mark every slot empty (all ones is DINDEX_EMPTY) and reset the header.
+  inode_fill(inodep, sizeof(dindex_header_t), 0xff, size - sizeof(dindex_header_t));
+
+  dindex_header_t *headerp = dindex_header(dnodep);
+  headerp->capacity = capacity;
+  headerp->used = 0;
+  headerp->deleted = 0;
+  headerp->holes = holes;
+
+  // Insert every live entry.
+  dirent_t *entryp;
+
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
+  {
+    dindex_place(inodep, headerp, dindex_hash(entryp->name), pos);
+  }
+
+  return 0;
+}
+
+int dindex_lookup(inode_t *dnodep, const char *name)
+{
+  assert(dnodep);
+  assert(name);
+
+  dindex_slot_t *slotp = dindex_find(dnodep, name);
+
+  // Return -ENOENT to indicate if no directory entry was found.
+  return slotp ? slotp->pos : -ENOENT;
+}
+
+int dindex_insert(inode_t *dnodep, const char *name, int pos)
+{
+  assert(dnodep);
+  assert(name);
+  assert(pos >= 0);
+
+  dindex_header_t *headerp = dindex_header(dnodep);
+
+  // Keep the load (including tombstones) under 3/4 so probe sequences stay short. A rebuild picks
+  // up the new entry itself since it is already in the directory.
+  if ((headerp->used + headerp->deleted + 1) * 4 > headerp->capacity * 3)
+  {
+    return dindex_rebuild(dnodep, headerp->capacity);
+  }
+
+  dindex_place(inode_get(inode_get_index(dnodep)), headerp, dindex_hash(name), pos);
+  return 0;
+}
+
+int dindex_remove(inode_t *dnodep, const char *name)
+{
+  assert(dnodep);
+  assert(name);
+
+  dindex_slot_t *slotp = dindex_find(dnodep, name);
+
+  if (!slotp)
+  {
+    return -ENOENT;
+  }
+
+  // Leave a tombstone so later entries in the same probe sequence can still be found.
+  int pos = slotp->pos;
+  slotp->pos = DINDEX_DELETED;
+
+  dindex_header_t *headerp = dindex_header(dnodep);
+  headerp->used--;
+  headerp->deleted++;
+
+  return pos;
+}
@@ -0,0 +1,52 @@
+// Hashed directory index.
+//
+// Large directories keep an open-addressing hash table mapping name hashes to entry positions so that
+// lookups, inserts and removals don't have to scan every directory entry. The table lives in the
+// data of a separate index inode referenced by the directory inode. The index inode has no file
+// type and is flagged INODE_FLAG_INTERNAL, since no directory entry refers to it. Small directories
+// have no index and are scanned linearly.
+
+#ifndef _DINDEX_H
+#define _DINDEX_H
+
+#include "util.h"
+#include "inode.h"
+
+// Directories get an index once they span more than a single block of entries.
+#define DINDEX_MIN_BLOCKS 2
+
+// Slot states stored in the position field.
+#define DINDEX_EMPTY   -1
+#define DINDEX_DELETED -2
+
+// Stored at the very start of the index inode's data, followed by the slots.
+typedef struct dindex_header
+{
+  int capacity; // number of slots (always a power of two)
+  int used;     // slots holding a live entry
+  int deleted;  // slots holding a tombstone
+  int holes;    // entries removed since the whole directory was last searched for free space
+} dindex_header_t;
+
+typedef struct dindex_slot
+{
+  unsigned int hash; // hash of the entry name
+  int pos;           // byte position of the directory entry, or DINDEX_EMPTY / DINDEX_DELETED
+} dindex_slot_t;
+
+unsigned int dindex_hash(const char *name);
+bool_t dindex_exists(inode_t *dnodep);
+dindex_header_t *dindex_header(inode_t *dnodep);
+void dindex_mark(inode_t *inodep);
+
+// Mark the index inodes of every directory, which images from before INODE_FLAG_INTERNAL left as
+// regular files.
+void dindex_mark_all(void);
+int dindex_create(inode_t *dnodep);
+void dindex_drop(inode_t *dnodep);
+int dindex_rebuild(inode_t *dnodep, int capacity);
+int dindex_lookup(inode_t *dnodep, const char *name);
+int dindex_insert(inode_t *dnodep, const char *name, int pos);
+int dindex_remove(inode_t *dnodep, const char *name);
+
+#endif
@@ -1,44 +1,72 @@
 #include <errno.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "specs.h"
 #include "bitmap.h"
 #include "inode.h"
 #include "directory.h"
+#include "dindex.h"
+#include "dcache.h"
 
-void directory_init(int inum)
+int directory_init(int inum)
 {
   assert(inum >= 0);
   assert(inode_exists(inum));
 
   inode_t *dnodep = inode_get(inum);
-  dnodep->mode = dnodep->mode & ~INODE_FILE | INODE_DIR;
+  inode_set_mode(dnodep, inode_get_mode(dnodep) & ~INODE_FILE | INODE_DIR);
 
-  directory_add_entry(inum, ".", inum, FALSE);
+  // The header is written along with the first block, when . is added.
+  inode_set_flags(dnodep, inode_get_flags(dnodep) | INODE_FLAG_DIRHDR | INODE_FLAG_DIRSUM);
+  int rv = directory_add_entry(inum, ".", inum, FALSE);
+
+  return rv < 0 ? rv : 0;
 }
 
-int directory_total_entry_count(inode_t *dnodep)
+dirhdr_t *directory_header(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
+
+  if (!(inode_get_flags(dnodep) & INODE_FLAG_DIRHDR) || inode_total_size(dnodep) == 0)
+  {
+    return NULL;
+  }
+
+  return block_get(inode_get_bnum(dnodep, 0));
+}
+
+int directory_records_start(inode_t *dnodep, int file_bnum)
+{
+  int flags = inode_get_flags(dnodep);
+
+  if (file_bnum > 0 || !(flags & INODE_FLAG_DIRHDR))
+  {
+    return 0;
+  }
 
-  // Determine how many entries are present (should be a clean divide).
-  return inode_total_size(dnodep) / sizeof(dirent_t);
+  return flags & INODE_FLAG_DIRSUM ? sizeof(dirhdr_t) : DIRHDR_V1_SIZE;
 }
 
 int directory_populated_entry_count(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
+
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  if (hdrp)
+  {
+    return hdrp->live_count;
+  }
 
   int count = 0;
+  dirent_t *entryp;
 
-  for (int entry_num = 0; entry_num < directory_total_entry_count(dnodep); entry_num++)
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
   {
-    if (directory_get_entry(dnodep, entry_num)->inum >= 0)
-    {
-      count++;
-    }
+    count++;
   }
 
   return count;
@@ -47,17 +75,23 @@ int directory_populated_entry_count(inode_t *dnodep)
 bool_t directory_is_empty(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
+
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  // Every directory holds . and .., so any other entry makes it non-empty.
+  if (hdrp)
+  {
+    return hdrp->live_count <= 2;
+  }
 
   dirent_t *entryp;
 
   // Search for anything that is not either . or .. in the directory.
-  for (int entry_num = 0; entry_num < directory_total_entry_count(dnodep); entry_num++)
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
   {
-    entryp = directory_get_entry(dnodep, entry_num);
-
-    // Check for an entry that is filled and where the name isn't either of the reserved links.
-    if (entryp->inum >= 0 && strcmp(entryp->name, ".") && strcmp(entryp->name, ".."))
+    // Check for an entry where the name isn't either of the reserved links.
+    if (strcmp(entryp->name, ".") && strcmp(entryp->name, ".."))
     {
       return FALSE;
     }
@@ -66,42 +100,113 @@ bool_t directory_is_empty(inode_t *dnodep)
   return TRUE;
 }
 
-dirent_t *directory_get_entry(inode_t *dnodep, int entry_num)
+dirent_t *directory_get_entry(inode_t *dnodep, int pos)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+  assert(pos >= 0);
+  assert(pos < inode_total_size(dnodep));
+
+  // Records never straddle blocks, so the position maps to a single block.
+  int bnum = inode_get_bnum(dnodep, pos >> BLOCK_SHIFT);
+
+  return block_get(bnum) + (pos & BLOCK_MASK);
+}
+
+int directory_seek(inode_t *dnodep, int pos)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+  assert(pos >= 0);
+
+  int size = inode_total_size(dnodep);
+
+  if (pos >= size)
+  {
+    return size;
+  }
+
+  // Records never straddle blocks, so walking the records of the block from its start finds the
+  // first one at or after the position.
+  int rec_pos = (pos & ~BLOCK_MASK) + directory_records_start(dnodep, pos >> BLOCK_SHIFT);
+
+  while (rec_pos < pos)
+  {
+    rec_pos += DIRENT_REC_LEN(directory_get_entry(dnodep, rec_pos));
+  }
+
+  return rec_pos;
+}
+
+dirent_t *directory_next_entry(inode_t *dnodep, int *posp)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
-  assert(entry_num >= 0);
-  assert(entry_num < directory_total_entry_count(dnodep));
+  assert(inode_is_dir(dnodep));
+  assert(posp);
 
-  int entry_block = (sizeof(dirent_t) * entry_num) / BLOCK_SIZE;
-  int entry_offset = (sizeof(dirent_t) * entry_num) % BLOCK_SIZE;
-  int bnum = inode_get_bnum(dnodep, entry_block);
+  int size = inode_total_size(dnodep);
+  dirent_t *entryp;
+
+  // The records start after the header.
+  *posp = MAX(*posp, directory_records_start(dnodep, 0));
+
+  // Skip over unused records until a live one is found.
+  while (*posp < size)
+  {
+    entryp = directory_get_entry(dnodep, *posp);
 
-  return block_get(bnum) + entry_offset;
+    if (entryp->inum >= 0)
+    {
+      return entryp;
+    }
+
+    *posp += DIRENT_REC_LEN(entryp);
+  }
+
+  // Return NULL once the end of the directory is reached.
+  return NULL;
 }
 
-int directory_lookup_entry_num(inode_t *dnodep, const char *name)
+int directory_lookup_pos(inode_t *dnodep, const char *name)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
   assert(name);
 
+  int name_len = strlen(name);
+
   // If the name is too long immediately rule it out.
-  if (strlen(name) > MAX_DIR_ENTRY_NAME_LEN - 1)
+  if (name_len > MAX_DIR_ENTRY_NAME_LEN - 1)
   {
     return -ENOENT;
   }
 
+  // Large directories are looked up through their hash index.
+  if (dindex_exists(dnodep))
+  {
+    return dindex_lookup(dnodep, name);
+  }
+
+  int block_count = inode_total_size(dnodep) >> BLOCK_SHIFT;
+  void *blockp;
   dirent_t *entryp;
 
-  // Search for an entry with the given name and return the entry number.
-  for (int entry_num = 0; entry_num < directory_total_entry_count(dnodep); entry_num++)
+  // Search for an entry with the given name and return its position. Records never straddle
+  // blocks, so each block is mapped once and then walked with plain pointer math.
+  for (int file_bnum = 0; file_bnum < block_count; file_bnum++)
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    blockp = block_get(inode_get_bnum(dnodep, file_bnum));
 
-    if (entryp->inum >= 0 && !strcmp(name, entryp->name))
+    for (int offset = directory_records_start(dnodep, file_bnum); offset < BLOCK_SIZE;
+         offset += DIRENT_REC_LEN(entryp))
     {
-      return entry_num;
+      entryp = blockp + offset;
+
+      if (entryp->inum >= 0 && entryp->name_len == name_len
+          && !memcmp(name, entryp->name, name_len))
+      {
+        return (file_bnum << BLOCK_SHIFT) + offset;
+      }
     }
   }
 
@@ -112,176 +217,429 @@ int directory_lookup_entry_num(inode_t *dnodep, const char *name)
 int directory_lookup_inum(inode_t *dnodep, const char *name)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
   assert(name);
 
-  int entry_num = directory_lookup_entry_num(dnodep, name);
+  // Recently resolved names are answered from the cache without touching the directory.
+  int inum = dcache_lookup(dnodep, name);
+
+  if (inum != DCACHE_MISS)
+  {
+    return inum;
+  }
+
+  // Remember the result either way, including names that don't exist.
+  int pos = directory_lookup_pos(dnodep, name);
+  inum = pos < 0 ? pos : directory_get_entry(dnodep, pos)->inum;
 
-  if  (entry_num < 0)
+  if (inum >= 0 || inum == -ENOENT)
   {
-    return entry_num;
+    dcache_insert(dnodep, name, inum);
   }
 
-  return directory_get_entry(dnodep, entry_num)->inum;
+  return inum;
 }
 
-int directory_rename_entry(inode_t *dnodep, int entry_num, const char *name)
+int directory_find_space(inode_t *dnodep, int rec_size, int first_bnum)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
-  assert(entry_num >= 0);
-  assert(directory_get_entry(dnodep, entry_num)->inum >= 0);
-  assert(name);
+  assert(inode_is_dir(dnodep));
+  assert(rec_size > 0);
+  assert(first_bnum >= 0);
 
-  // Ensure the name is not too long.
-  if (strlen(name) >= MAX_DIR_ENTRY_NAME_LEN)
+  int block_count = inode_total_size(dnodep) >> BLOCK_SHIFT;
+  void *blockp;
+  dirent_t *entryp;
+  int used;
+
+  // Look for a record with enough slack after its own name to hold the new record.
+  for (int file_bnum = first_bnum; file_bnum < block_count; file_bnum++)
   {
-    return -ENAMETOOLONG;
+    blockp = block_get(inode_get_bnum(dnodep, file_bnum));
+
+    for (int offset = directory_records_start(dnodep, file_bnum); offset < BLOCK_SIZE;
+         offset += DIRENT_REC_LEN(entryp))
+    {
+      entryp = blockp + offset;
+      used = entryp->inum < 0 ? 0 : DIRENT_SIZE(entryp->name_len);
+
+      if (DIRENT_REC_LEN(entryp) - used >= rec_size)
+      {
+        return (file_bnum << BLOCK_SHIFT) + offset;
+      }
+    }
   }
 
-  // Ensure an entry with the given name does not already exist.
-  if (directory_lookup_entry_num(dnodep, name) >= 0)
+  // Return -ENOSPC to indicate that the directory needs another block.
+  return -ENOSPC;
+}
+
+// Write a new entry into the record at the given position, splitting off the record's slack if the
+// record is already in use. Returns the position of the new entry.
+int directory_insert_at(inode_t *dnodep, int pos, const char *name, int entry_inum)
+{
+  assert(dnodep);
+  assert(name);
+
+  dirent_t *entryp = directory_get_entry(dnodep, pos);
+
+  if (entryp->inum >= 0)
   {
-    return -EEXIST;
+    int used = DIRENT_SIZE(entryp->name_len);
+    dirent_t *newp = (void *) entryp + used;
+
+    newp->rec_len = DIRENT_REC_LEN(entryp) - used;
+    entryp->rec_len = used;
+
+    entryp = newp;
+    pos += used;
   }
 
-  // Copy the name into the buffer and ensure a null terminator is included.
-  dirent_t *entryp = directory_get_entry(dnodep, entry_num);
-  strcpy(entryp->name, name);
+  // Copy the name into the record and ensure a null terminator is included.
+  entryp->inum = entry_inum;
+  entryp->name_len = strlen(name);
+  entryp->type = DIRENT_TYPE(inode_get_mode(inode_get(entry_inum)));
+  memcpy(entryp->name, name, entryp->name_len + 1);
+
+  // A new entry is usually looked up right away.
+  dcache_insert(dnodep, name, entry_inum);
 
-  // Return the entry number.
-  return entry_num;
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  if (hdrp)
+  {
+    hdrp->live_count++;
+  }
+
+  return pos;
 }
 
-int directory_add_entry(int dinum, const char *name, int entry_inum, bool_t back_entry_in_child)
+// Unlink the record at the given position, merging its space into the record before it.
+void directory_remove_at(inode_t *dnodep, int pos)
 {
-  assert(dinum >= 0);
-  assert(inode_exists(dinum));
-  
-  inode_t *dnodep = inode_get(dinum);
+  assert(dnodep);
+
+  dirent_t *entryp = directory_get_entry(dnodep, pos);
+
+  assert(entryp->inum >= 0);
+
+  dcache_remove(dnodep, entryp->name);
+
+  // Drop the entry from the index, which now has one more hole to fill.
+  if (dindex_exists(dnodep))
+  {
+    dindex_remove(dnodep, entryp->name);
+    dindex_header(dnodep)->holes++;
+  }
+
+  // The block the entry was in has room again.
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  if (hdrp)
+  {
+    hdrp->live_count--;
+    hdrp->tombstones++;
+    hdrp->free_bnum = MIN(hdrp->free_bnum, pos >> BLOCK_SHIFT);
+  }
+
+  int offset = pos & BLOCK_MASK;
+  int start = directory_records_start(dnodep, pos >> BLOCK_SHIFT);
+
+  // The first record of a block has nothing to merge into, so it is just marked unused.
+  if (offset == start)
+  {
+    entryp->inum = -1;
+    return;
+  }
+
+  // Find the record directly before this one and give it this record's space.
+  void *blockp = (void *) entryp - offset;
+  dirent_t *prevp = blockp + start;
+
+  while ((void *) prevp + DIRENT_REC_LEN(prevp) != (void *) entryp)
+  {
+    prevp = (void *) prevp + DIRENT_REC_LEN(prevp);
+  }
+
+  prevp->rec_len = DIRENT_REC_LEN(prevp) + DIRENT_REC_LEN(entryp);
+}
 
-  assert(dnodep->mode & INODE_DIR);
+// Add an entry to the directory, returning its position.
+int directory_insert_entry(inode_t *dnodep, const char *name, int entry_inum)
+{
+  assert(dnodep);
   assert(name);
-  assert(entry_inum >= 0);
-  assert(inode_exists(entry_inum));
+
+  int name_len = strlen(name);
 
   // Ensure the name is not too long.
-  if (strlen(name) >= MAX_DIR_ENTRY_NAME_LEN)
+  if (name_len >= MAX_DIR_ENTRY_NAME_LEN)
   {
     return -ENAMETOOLONG;
   }
-  
-  dirent_t *entryp;
-  int total_entry_count = directory_total_entry_count(dnodep);
-  int entry_num;
 
-  // Find an open entry if one exists.
-  for (entry_num = 0; entry_num < total_entry_count; entry_num++)
+  int rec_size = DIRENT_SIZE(name_len);
+  int block_count = inode_total_size(dnodep) >> BLOCK_SHIFT;
+  int pos;
+
+  // Indicate that a file with the given name already exists. Creating a file usually just looked the
+  // name up and found nothing, so the cache can tell the name is free without another search.
+  if (directory_lookup_inum(dnodep, name) >= 0)
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    return -EEXIST;
+  }
 
-    // Indicate that a file with the given name already exists.
-    if (!strcmp(name, entryp->name))
-    {
-      return -EEXIST;
-    }
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  // The header knows the first block that may have room.
+  if (hdrp)
+  {
+    pos = directory_find_space(dnodep, rec_size, hdrp->free_bnum);
+  }
+  else if (dindex_exists(dnodep))
+  {
+    // Appending to the last block is the common case. Only look further back if the index knows
+    // entries have been removed since the last time the whole directory was searched.
+    pos = directory_find_space(dnodep, rec_size, MAX(0, block_count - 1));
 
-    if (entryp->inum < 0)
+    if (pos < 0 && dindex_header(dnodep)->holes > 0)
     {
-      break;
+      pos = directory_find_space(dnodep, rec_size, 0);
+      dindex_header(dnodep)->holes = pos < 0 ? 0 : dindex_header(dnodep)->holes - 1;
     }
   }
+  else
+  {
+    pos = directory_find_space(dnodep, rec_size, 0);
+  }
 
-  // If we didn't find an empty entry, create a new one.
-  if (entry_num >= total_entry_count)
+  // If no record has room, add a new block holding a single unused record.
+  if (pos < 0)
   {
-    // Since no open entry exists, create a new one and grow the inode. If the inode returns -ENOSPC
-    // indicating that the disk is full, return -ENOSPC immediately.
-    if (inode_grow(dnodep, sizeof(dirent_t)) < 0)
+    // If the inode returns -ENOSPC indicating that the disk is full, return -ENOSPC immediately.
+    if (inode_grow(dnodep, BLOCK_SIZE) < 0)
     {
       return -ENOSPC;
     }
 
-    // Use the newly allocated entry (not zeroed out because we will set all the data anyways).
-    entryp = directory_get_entry(dnodep, total_entry_count);
+    // The first block of a directory with a header starts with it.
+    int start = directory_records_start(dnodep, block_count);
+
+    if (start > 0)
+    {
+      hdrp = directory_header(dnodep);
+      memset(hdrp, 0, start);
+    }
+
+    pos = (block_count << BLOCK_SHIFT) + start;
+
+    dirent_t *entryp = directory_get_entry(dnodep, pos);
+    entryp->inum = -1;
+    entryp->rec_len = BLOCK_SIZE - start; // wraps to 0 for 64KB blocks, see DIRENT_REC_LEN
+  }
+  // Space anywhere but after the last record was left by a removed entry.
+  else if (hdrp && hdrp->tombstones > 0
+           && pos + DIRENT_REC_LEN(directory_get_entry(dnodep, pos)) < block_count << BLOCK_SHIFT)
+  {
+    hdrp->tombstones--;
   }
 
-  // Insert the proper data into the entry.
-  entryp->inum = entry_inum;
-  directory_rename_entry(dnodep, entry_num, name);
+  // No block before this one had room.
+  if (hdrp)
+  {
+    hdrp->free_bnum = pos >> BLOCK_SHIFT;
+  }
+
+  pos = directory_insert_at(dnodep, pos, name, entry_inum);
 
-  // Put an entry for .. in the child if it is a directory and this option is requested.
-  if (back_entry_in_child && inode_get(entry_inum)->mode & INODE_DIR)
+  if (dindex_exists(dnodep))
+  {
+    dindex_insert(dnodep, name, pos);
+  }
+  // Once the directory outgrows a single block, build an index for it. If there is no space for
+  // the index, the directory simply keeps being scanned linearly.
+  else if (inode_total_size(dnodep) >> BLOCK_SHIFT >= DINDEX_MIN_BLOCKS)
   {
-    directory_add_entry(entry_inum, "..", dinum, FALSE);
+    dindex_create(dnodep);
   }
 
-  // Return the directory entry index.
-  return entry_num;
+  return pos;
 }
 
-int directory_remove_entry(inode_t *dnodep, const char *name, bool_t back_entry_in_child)
+int directory_rename_entry(inode_t *dnodep, int pos, const char *name)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
+  assert(pos >= 0);
+  assert(directory_get_entry(dnodep, pos)->inum >= 0);
   assert(name);
 
-  dirent_t *entryp;
-  inode_t *entry_nodep;
+  int name_len = strlen(name);
+
+  // Ensure the name is not too long.
+  if (name_len >= MAX_DIR_ENTRY_NAME_LEN)
+  {
+    return -ENAMETOOLONG;
+  }
+
+  // Ensure an entry with the given name does not already exist.
+  if (directory_lookup_inum(dnodep, name) >= 0)
+  {
+    return -EEXIST;
+  }
+
+  dirent_t *entryp = directory_get_entry(dnodep, pos);
+  inode_touch(dnodep, INODE_MTIME | INODE_CTIME);
+
+  // If the new name doesn't fit in the record, move the entry to a record that has room.
+  if (DIRENT_SIZE(name_len) > DIRENT_REC_LEN(entryp))
+  {
+    int entry_inum = entryp->inum;
+    directory_remove_at(dnodep, pos);
+    return directory_insert_entry(dnodep, name, entry_inum);
+  }
+
+  // Otherwise rewrite the name in place. The index and the cache are keyed by name so the entry
+  // must be moved to its new slot.
+
+  if (dindex_exists(dnodep))
+  {
+    dindex_remove(dnodep, entryp->name);
+  }
 
-  int entry_num;
-  int total_entry_count = directory_total_entry_count(dnodep);
+  dcache_remove(dnodep, entryp->name);
+  entryp->name_len = name_len;
+  memcpy(entryp->name, name, name_len + 1);
+  dcache_insert(dnodep, name, entryp->inum);
 
-  for (entry_num = 0; entry_num < total_entry_count; entry_num++)
+  if (dindex_exists(dnodep))
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    int rv = dindex_insert(dnodep, name, pos);
 
-    if (!strcmp(name, entryp->name))
+    if (rv < 0)
     {
-      entry_nodep = inode_get(entryp->inum);
+      return rv;
+    }
+  }
 
-      entryp->inum = -1;
+  // Return the entry position.
+  return pos;
+}
 
-      // Remove the entry for .. in the child if it is a directory and this option is requested.
-      if (back_entry_in_child && entry_nodep->mode & INODE_DIR)
-      {
-        directory_remove_entry(entry_nodep, "..", FALSE);
-      }
+int directory_add_entry(int dinum, const char *name, int entry_inum, bool_t back_entry_in_child)
+{
+  assert(dinum >= 0);
+  assert(inode_exists(dinum));
 
-      // Drop the empty ending entries if there are any.
-      int rv = directory_prune(dnodep);
+  inode_t *dnodep = inode_get(dinum);
 
-      if (rv < 0)
-      {
-        return rv;
-      }
+  assert(inode_is_dir(dnodep));
+  assert(name);
+  assert(entry_inum >= 0);
+  assert(inode_exists(entry_inum));
+
+  int pos = directory_insert_entry(dnodep, name, entry_inum);
+
+  if (pos < 0)
+  {
+    return pos;
+  }
+
+  inode_touch(dnodep, INODE_MTIME | INODE_CTIME);
+
+  // Put an entry for .. in the child if it is a directory and this option is requested. Without it
+  // the child couldn't be walked back up from, so the new entry goes again if it can't be added.
+  if (back_entry_in_child && inode_is_dir(inode_get(entry_inum)))
+  {
+    int rv = directory_add_entry(entry_inum, "..", dinum, FALSE);
 
-      return 0;
+    if (rv < 0)
+    {
+      directory_remove_entry(dnodep, name, FALSE);
+      return rv;
     }
   }
 
-  return -ENOENT;
+  // Return the directory entry position.
+  return pos;
+}
+
+int directory_remove_entry(inode_t *dnodep, const char *name, bool_t back_entry_in_child)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+  assert(name);
+
+  // Find the entry, either through the index or by scanning.
+  int pos = directory_lookup_pos(dnodep, name);
+
+  if (pos < 0)
+  {
+    return pos;
+  }
+
+  inode_t *entry_nodep = inode_get(directory_get_entry(dnodep, pos)->inum);
+
+  directory_remove_at(dnodep, pos);
+  inode_touch(dnodep, INODE_MTIME | INODE_CTIME);
+
+  // Remove the entry for .. in the child if it is a directory and this option is requested.
+  if (back_entry_in_child && inode_is_dir(entry_nodep))
+  {
+    directory_remove_entry(entry_nodep, "..", FALSE);
+  }
+
+  // Drop the empty ending blocks if there are any.
+  int rv = directory_prune(dnodep);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  return 0;
+}
+
+int directory_set_parent(inode_t *dnodep, int parent_inum)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+  assert(parent_inum >= 0);
+
+  int pos = directory_lookup_pos(dnodep, "..");
+
+  if (pos < 0)
+  {
+    return pos;
+  }
+
+  // The name stays the same, so the index doesn't change but the cached entry does.
+  directory_get_entry(dnodep, pos)->inum = parent_inum;
+  dcache_insert(dnodep, "..", parent_inum);
+  return 0;
 }
 
 int directory_prune(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
 
   dirent_t *entryp;
+  int size;
 
-  for (int entry_num = directory_total_entry_count(dnodep) - 1; entry_num >= 0; entry_num--)
+  while ((size = inode_total_size(dnodep)) > 0)
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    int start = directory_records_start(dnodep, (size >> BLOCK_SHIFT) - 1);
+    entryp = directory_get_entry(dnodep, size - BLOCK_SIZE + start);
 
-    // Once a non-empty entry is found we are finished pruning.
-    if (entryp->inum >= 0)
+    // Once a block holding anything is found we are finished pruning.
+    if (entryp->inum >= 0 || DIRENT_REC_LEN(entryp) != BLOCK_SIZE - start)
     {
       break;
     }
 
-    // If the last entry is empty, shrink the directory.
-    int rv = inode_shrink(dnodep, sizeof(dirent_t));
+    // If the last block is empty, shrink the directory.
+    int rv = inode_shrink(dnodep, BLOCK_SIZE);
 
     if (rv < 0)
     {
@@ -293,44 +651,266 @@ int directory_prune(inode_t *dnodep)
   return 0;
 }
 
-slist_t *directory_list(inode_t *dnodep)
+bool_t directory_needs_compact(inode_t *dnodep)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+
+  dirhdr_t *hdrp = directory_header(dnodep);
+
+  return hdrp && hdrp->tombstones >= DIRECTORY_COMPACT_MIN && hdrp->tombstones > hdrp->live_count
+         && inode_total_size(dnodep) > BLOCK_SIZE;
+}
+
+// Lay the packed records in the buffer out from the start of the directory, moving on to the next
+// block whenever a record doesn't fit in the current one, and return the position of the last one.
+// Nothing is written unless write is set, so the blocks needed can be counted first.
+int directory_lay_out(inode_t *dnodep, const char *bufp, int used, bool_t write)
+{
+  int pos = directory_records_start(dnodep, 0);
+  int last_pos = pos;
+
+  for (int offset = 0; offset < used; offset += ((const dirent_t *) (bufp + offset))->rec_len)
+  {
+    const dirent_t *copyp = (const dirent_t *) (bufp + offset);
+
+    if ((pos & BLOCK_MASK) + copyp->rec_len > BLOCK_SIZE)
+    {
+      if (write)
+      {
+        directory_get_entry(dnodep, last_pos)->rec_len = BLOCK_SIZE - (last_pos & BLOCK_MASK);
+      }
+
+      pos = (pos & ~BLOCK_MASK) + BLOCK_SIZE;
+    }
+
+    if (write)
+    {
+      memcpy(directory_get_entry(dnodep, pos), copyp, copyp->rec_len);
+    }
+
+    last_pos = pos;
+    pos += copyp->rec_len;
+  }
+
+  // The last record takes up the rest of its block. Wraps to 0 for a whole 64KB block.
+  if (write)
+  {
+    directory_get_entry(dnodep, last_pos)->rec_len = BLOCK_SIZE - (last_pos & BLOCK_MASK);
+  }
+
+  return last_pos;
+}
+
+int directory_compact(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
+
+  int size = inode_total_size(dnodep);
 
-  slist_t *list = NULL;
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  // Copy the live records out, packed back to back with no slack.
+  char *bufp = malloc(size);
+
+  if (!bufp)
+  {
+    return -ENOMEM;
+  }
+
+  int used = 0;
+  int live_count = 0;
   dirent_t *entryp;
 
-  for (int entry_num = directory_total_entry_count(dnodep) - 1; entry_num >= 0; entry_num--)
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    dirent_t *copyp = (dirent_t *) (bufp + used);
+    memcpy(copyp, entryp, DIRENT_SIZE(entryp->name_len));
+    copyp->rec_len = DIRENT_SIZE(entryp->name_len);
+    used += copyp->rec_len;
+    live_count++;
+  }
 
-    // Ensure the inum is at least 0.
-    if (entryp->inum >= 0)
+  // Keep the totals, if the header has them yet.
+  dirhdr_t totals;
+  memset(&totals, 0, sizeof(totals));
+
+  if (directory_totals(dnodep))
+  {
+    totals = *directory_totals(dnodep);
+  }
+
+  // A directory from before headers or totals gets a full header now. That can push the records
+  // into one more block than before, so count the blocks first.
+  int flags = inode_get_flags(dnodep);
+  inode_set_flags(dnodep, flags | INODE_FLAG_DIRHDR | INODE_FLAG_DIRSUM);
+
+  int block_count = (directory_lay_out(dnodep, bufp, used, FALSE) >> BLOCK_SHIFT) + 1;
+  int rv = block_count > size >> BLOCK_SHIFT ? inode_grow(dnodep, BLOCK_SIZE) : 0;
+
+  if (rv < 0)
+  {
+    inode_set_flags(dnodep, flags);
+    free(bufp);
+    return rv;
+  }
+
+  directory_lay_out(dnodep, bufp, used, TRUE);
+  free(bufp);
+
+  dirhdr_t *hdrp = directory_header(dnodep);
+  hdrp->live_count = live_count;
+  hdrp->free_bnum = block_count - 1;
+  hdrp->tombstones = 0;
+  hdrp->reserved = 0;
+  hdrp->tree_bytes = totals.tree_bytes;
+  hdrp->tree_files = totals.tree_files;
+  hdrp->tree_dirs = totals.tree_dirs;
+
+  // Give back the blocks that are no longer used.
+  size = inode_total_size(dnodep);
+  rv = inode_shrink(dnodep, size - ((off_t) block_count << BLOCK_SHIFT));
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Every entry moved, so the index has to be rebuilt, or dropped if the directory is small enough
+  // to be scanned again. The entry cache maps names to inodes rather than to positions, so it stays
+  // valid as it is.
+  if (dindex_exists(dnodep))
+  {
+    if (block_count < DINDEX_MIN_BLOCKS)
+    {
+      dindex_drop(dnodep);
+    }
+    else
     {
-      list = slist_cons(entryp->name, list);
+      dindex_header(dnodep)->holes = 0;
+      dindex_rebuild(dnodep, 0);
     }
   }
 
-  return list;
+  // Return the number of blocks freed.
+  return (size >> BLOCK_SHIFT) - block_count;
+}
+
+dirhdr_t *directory_totals(inode_t *dnodep)
+{
+  assert(dnodep);
+
+  return inode_get_flags(dnodep) & INODE_FLAG_DIRSUM ? directory_header(dnodep) : NULL;
+}
+
+void directory_account(inode_t *dnodep, int64_t bytes, int files, int dirs)
+{
+  assert(dnodep);
+  assert(inode_is_dir(dnodep));
+
+  // Add to the totals of the directory and of every directory above it, up to the root, whose ..
+  // refers to itself.
+  while (TRUE)
+  {
+    dirhdr_t *hdrp = directory_totals(dnodep);
+
+    if (hdrp)
+    {
+      hdrp->tree_bytes += bytes;
+      hdrp->tree_files += files;
+      hdrp->tree_dirs += dirs;
+    }
+
+    int parent_inum = directory_lookup_inum(dnodep, "..");
+
+    if (parent_inum < 0 || inode_get(parent_inum) == dnodep)
+    {
+      return;
+    }
+
+    dnodep = inode_get(parent_inum);
+  }
+}
+
+int directory_sum_tree(int dinum)
+{
+  assert(dinum >= 0);
+
+  inode_t *dnodep = inode_get(dinum);
+  assert(inode_is_dir(dnodep));
+
+  // Give the directory a header with room for the totals.
+  int rv = directory_compact(dnodep);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Add up the directories below first. A file with several links only counts in the first
+  // directory it is found in.
+  dirhdr_t totals;
+  memset(&totals, 0, sizeof(totals));
+  dirent_t *entryp;
+
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
+  {
+    if (strcmp(entryp->name, ".") == 0 || strcmp(entryp->name, "..") == 0)
+    {
+      continue;
+    }
+
+    inode_t *nodep = inode_get(entryp->inum);
+
+    if (inode_is_dir(nodep))
+    {
+      if ((rv = directory_sum_tree(entryp->inum)) < 0)
+      {
+        return rv;
+      }
+
+      dirhdr_t *child_hdrp = directory_totals(nodep);
+      totals.tree_bytes += child_hdrp->tree_bytes;
+      totals.tree_files += child_hdrp->tree_files;
+      totals.tree_dirs += child_hdrp->tree_dirs + 1;
+    }
+    else if (inode_get_parent(nodep) < 0)
+    {
+      inode_set_parent(nodep, dinum);
+      totals.tree_bytes += inode_total_size(nodep);
+      totals.tree_files++;
+    }
+  }
+
+  dirhdr_t *hdrp = directory_totals(dnodep);
+  hdrp->tree_bytes = totals.tree_bytes;
+  hdrp->tree_files = totals.tree_files;
+  hdrp->tree_dirs = totals.tree_dirs;
+  return 0;
 }
 
 void directory_print_entries(inode_t *dnodep, bool_t include_empty_entries)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
 
   dirent_t *entryp;
 
-  printf("\033[0;1mIdx\tiNum\tName\033[0m\n");
+  printf("\033[0;1mPos\tiNum\tLen\tName\033[0m\n");
 
-  for (int entry_num = 0; entry_num < directory_total_entry_count(dnodep); entry_num++)
+  for (int pos = directory_records_start(dnodep, 0); pos < inode_total_size(dnodep);
+       pos += DIRENT_REC_LEN(entryp))
   {
-    entryp = directory_get_entry(dnodep, entry_num);
+    entryp = directory_get_entry(dnodep, pos);
 
     if (include_empty_entries || entryp->inum >= 0)
     {
-      printf("%d\t%d\t%s\n", entry_num, entryp->inum, entryp->name);
+      printf("%d\t%d\t%d\t%s\n", pos, entryp->inum, DIRENT_REC_LEN(entryp),
+             entryp->inum >= 0 ? entryp->name : "");
     }
   }
 }
@@ -338,17 +918,15 @@ void directory_print_entries(inode_t *dnodep, bool_t include_empty_entries)
 void directory_print_leveled_tree(inode_t *dnodep, int level)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
   assert(level >= 0);
 
   dirent_t *entryp;
   inode_t *subnodep;
 
-  for (int entry_num = 0; entry_num < directory_total_entry_count(dnodep); entry_num++)
+  for (int pos = 0; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
   {
-    entryp = directory_get_entry(dnodep, entry_num);
-
-    if (entryp->inum < 0 || !strcmp(entryp->name, ".") || !strcmp(entryp->name, ".."))
+    if (!strcmp(entryp->name, ".") || !strcmp(entryp->name, ".."))
     {
       continue;
     }
@@ -358,7 +936,7 @@ void directory_print_leveled_tree(inode_t *dnodep, int level)
 
     subnodep = inode_get(entryp->inum);
 
-    if (subnodep->mode & INODE_DIR)
+    if (inode_is_dir(subnodep))
     {
       directory_print_leveled_tree(subnodep, level + 1);
     }
@@ -368,7 +946,7 @@ void directory_print_leveled_tree(inode_t *dnodep, int level)
 void directory_print_tree(inode_t *dnodep)
 {
   assert(dnodep);
-  assert(dnodep->mode & INODE_DIR);
+  assert(inode_is_dir(dnodep));
 
   // Call the recursive helper.
   directory_print_leveled_tree(dnodep, 0);
@@ -6,33 +6,91 @@
 #ifndef _DIRECTORY_H
 #define _DIRECTORY_H
 
-#define MAX_DIR_ENTRY_NAME_LEN 60
+#define MAX_DIR_ENTRY_NAME_LEN 256
 
+// Records are padded so that every header stays 4-byte aligned.
+#define DIRENT_ALIGN 4
+
+// Number of bytes a record with a name of the given length occupies (header, name and terminator).
+#define DIRENT_SIZE(name_len) \
+    ((sizeof(dirent_t) + (name_len) + 1 + DIRENT_ALIGN - 1) & ~(DIRENT_ALIGN - 1))
+
+// Length of the given record. rec_len is only 16 bits wide, so a record spanning an entire 64KB block
+// is stored with a rec_len of 0, the same trick ext4 uses.
+#define DIRENT_REC_LEN(entryp) ((entryp)->rec_len ? (entryp)->rec_len : BLOCK_SIZE)
+
+// A directory is compacted automatically once at least this many removed entries haven't had their
+// space reused, and they outnumber the live ones.
+#define DIRECTORY_COMPACT_MIN 64
+
+// Directory entry type byte for the given mode. Uses the same values as DT_* in <dirent.h>.
+#define DIRENT_TYPE(mode) (((mode) >> 12) & 017)
+
+#include <stddef.h>
 #include "util.h"
 #include "block.h"
 #include "inode.h"
-#include "slist.h"
 
-// Size of exactly 64
+// Stored at the very start of the first block of a directory, in front of its records, so that
+// emptiness checks and finding room for a new entry don't have to scan the whole directory.
+// Directories created before the header existed don't have one (INODE_FLAG_DIRHDR is clear) and are
+// scanned instead.
+//
+// The header also keeps totals for the whole tree below the directory, which every change adds to
+// all the way up to the root, so asking how much a tree holds doesn't have to walk it. Headers from
+// before the totals (INODE_FLAG_DIRSUM is clear) end after the reserved field.
+typedef struct dirhdr
+{
+  int live_count;     // entries in use, including . and ..
+  int free_bnum;      // no block before this one had room for the last entry added
+  int tombstones;     // roughly, removed entries whose space hasn't been reused yet
+  int reserved;       // zero
+  int64_t tree_bytes; // bytes in the files and symbolic links anywhere below the directory
+  int tree_files;     // files and symbolic links below it, each counted once in one directory
+  int tree_dirs;      // directories below it, not counting itself
+} dirhdr_t;
+
+// Size of a header without the totals.
+#define DIRHDR_V1_SIZE offsetof(dirhdr_t, tree_bytes)
+
+// A variable-length directory entry record. Every directory block is completely tiled by records,
+// so rec_len can be larger than the record needs; the slack is free space a new entry can be split
+// into. Only the first record of a block is ever unused, since removing any other record merges it
+// into the record before it.
 typedef struct dirent {
-  char name[MAX_DIR_ENTRY_NAME_LEN]; // Note that this string is guarunteed to have a null
-                                     // terminator for safety. This means its content length is
-                                     // MAX_DIR_ENTRY_NAME_LEN - 1.
-  int inum; // -1 if unused
+  int inum;               // -1 if unused
+  unsigned short rec_len; // bytes to the start of the next record, read through DIRENT_REC_LEN
+  unsigned char name_len; // length of the name, not counting the null terminator
+  unsigned char type;     // DIRENT_TYPE of the inode
+  char name[];            // name_len bytes followed by a null terminator for safety
 } dirent_t;
 
-void directory_init(int inum);
-int directory_total_entry_count(inode_t *dnodep);
+int directory_init(int inum);
+dirhdr_t *directory_header(inode_t *dnodep);
+int directory_records_start(inode_t *dnodep, int file_bnum);
 int directory_populated_entry_count(inode_t *dnodep);
 bool_t directory_is_empty(inode_t *dnodep);
-dirent_t *directory_get_entry(inode_t *dnodep, int entry_num);
-int directory_lookup_entry_num(inode_t *dnodep, const char *name);
+dirent_t *directory_get_entry(inode_t *dnodep, int pos);
+dirent_t *directory_next_entry(inode_t *dnodep, int *posp);
+
+// Returns the position of the first record starting at or after the given position, which need not
+// be the start of a record. Records never move while they are in use, so a listing can be resumed
+// from the position of the record it would have returned next, even if that record was removed (and
+// merged into the one before it) in the meantime.
+int directory_seek(inode_t *dnodep, int pos);
+int directory_lookup_pos(inode_t *dnodep, const char *name);
 int directory_lookup_inum(inode_t *dnodep, const char *name);
-int directory_rename_entry(inode_t *dnodep, int entry_num, const char *name);
+int directory_rename_entry(inode_t *dnodep, int pos, const char *name);
+int directory_find_space(inode_t *dnodep, int rec_size, int first_bnum);
 int directory_add_entry(int dinum, const char *name, int entry_inum, bool_t back_entry_in_child);
 int directory_remove_entry(inode_t *dnodep, const char *name, bool_t back_entry_in_child);
+int directory_set_parent(inode_t *dnodep, int parent_inum);
 int directory_prune(inode_t *dnodep);
-slist_t *directory_list(inode_t *dnodep);
+bool_t directory_needs_compact(inode_t *dnodep);
+int directory_compact(inode_t *dnodep);
+dirhdr_t *directory_totals(inode_t *dnodep);
+void directory_account(inode_t *dnodep, int64_t bytes, int files, int dirs);
+int directory_sum_tree(int dinum);
 void directory_print_entries(inode_t *dnodep, bool_t include_empty_entries);
 void directory_print_tree(inode_t *dnodep);
 
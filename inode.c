@@ -9,282 +9,1749 @@
 #include "inode.h"
 #include "util.h"
 
+// Lowest group that might still have a free inode. Every group below it is known to be full.
+static int group_hint = 0;
+
+// Stands in for the data of holes, which read back as zeroes. It is never written to.
+static byte_t zero_block[MAX_BLOCK_SIZE];
+
+// The extent each recently used inode last looked up. Reading or writing a file block by block keeps
+// hitting the same extent or the one after it, which is checked first instead of binary searching
+// all the extents (and reading their leaf blocks) again. Entries are only hints that are checked
+// against the extents on every use, so nothing that changes the extents has to keep them coherent.
+static inode_map_hint_t map_hints[INODE_MAP_HINTS];
+
+// Inodes given blocks past their end by inode_speculate() during this mount, so the blocks can be
+// taken back when space runs out.
+static inode_t *prealloc_nodes[INODE_PREALLOC_FILES];
+static int prealloc_count = 0;
+
+// Get the number of bytes the group descriptor table needs to describe the given number of groups.
+size_t inode_gdt_size(int group_max)
+{
+  return (size_t) group_max * sizeof(inode_group_t);
+}
+
+// Record the inode geometry in the superblock and add the initial groups of a freshly formatted
+// image.
+int inode_format(int group_count, int group_max)
+{
+  assert(group_count <= group_max);
+
+  superblock_t *sbp = block_superblock();
+  sbp->inode_size = INODE_SIZE;
+  sbp->inode_group_size = INODE_GROUP_SIZE;
+  sbp->inode_group_max = group_max;
+  sbp->orphan_inum = -1;
+
+  inode_init();
+
+  for (int group_num = 0; group_num < group_count; group_num++)
+  {
+    int rv = inode_group_add();
+
+    if (rv < 0)
+    {
+      return rv;
+    }
+  }
+
+  return 0;
+}
+
+void inode_init(void)
+{
+  group_hint = 0;
+  prealloc_count = 0;
+  memset(map_hints, 0, sizeof(map_hints));
+}
+
+inode_group_t *inode_group(int group_num)
+{
+  assert(group_num >= 0);
+  assert(group_num < block_superblock()->inode_group_count);
+
+  return block_gdt_start() + sizeof(inode_group_t) * group_num;
+}
+
+// Add a new group to the end of the table, returning its number.
+int inode_group_add(void)
+{
+  superblock_t *sbp = block_superblock();
+
+  // The descriptor table was sized at format time.
+  if (sbp->inode_group_count >= sbp->inode_group_max)
+  {
+    return -ENOSPC;
+  }
+
+  // The slice of the table must be contiguous so inodes can be found with plain pointer math.
+  int bnum = block_alloc_run(INODE_GROUP_BLOCKS);
+
+  if (bnum < 0)
+  {
+    return bnum;
+  }
+
+  memset(block_get(bnum), 0, (size_t) INODE_GROUP_BLOCKS << BLOCK_SHIFT);
+
+  int group_num = sbp->inode_group_count++;
+  sbp->inode_count += INODE_GROUP_SIZE;
+
+  inode_group_t *groupp = inode_group(group_num);
+  memset(groupp, 0, sizeof(inode_group_t));
+  groupp->table_bnum = bnum;
+  groupp->free_count = INODE_GROUP_SIZE;
+
+  printf("inode_group_add() -> %d\n", group_num);
+
+  return group_num;
+}
+
 bool_t inode_exists(int inum)
 {
   assert(inum >= 0);
 
-  return bitmap_get(block_inode_bitmap_start(), inum);
-}
+  if (inum >= block_inode_count())
+  {
+    return FALSE;
+  }
+
+  return bitmap_get(inode_group(inum / INODE_GROUP_SIZE)->bitmap, inum % INODE_GROUP_SIZE);
+}
+
+// Get the inode with the given number whether or not it is in use.
+inode_t *inode_slot(int inum)
+{
+  inode_group_t *groupp = inode_group(inum / INODE_GROUP_SIZE);
+  return block_get(groupp->table_bnum) + sizeof(inode_t) * (inum % INODE_GROUP_SIZE);
+}
+
+inode_t *inode_get(int inum)
+{
+  assert(inum < block_inode_count());
+  assert(inode_exists(inum));
+
+  // Return the proper inode at the given offset in its group.
+  return inode_slot(inum);
+}
+
+// Timestamps are stored on disk as a single count of nanoseconds since the epoch.
+int64_t inode_pack_time(struct timespec ts)
+{
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct timespec inode_unpack_time(int64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+
+  // Keep tv_nsec in range for times before the epoch.
+  if (ts.tv_nsec < 0)
+  {
+    ts.tv_sec--;
+    ts.tv_nsec += 1000000000;
+  }
+
+  return ts;
+}
+
+void inode_reset(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Start from all zeroes so the reserved fields and padding stay zero on disk.
+  memset(nodep, 0, sizeof(inode_t));
+
+  nodep->mode = 0100644;
+  nodep->extent_bnum = -1;
+  memset(nodep->extents, -1, sizeof(extent_t) * INODE_LOCAL_EXTENT_CAP);
+  nodep->index_inum = -1;
+  nodep->tail_bnum = -1;
+
+  // A fresh inode was created, accessed, modified and changed right now.
+  inode_touch(nodep, INODE_ATIME | INODE_MTIME | INODE_CTIME);
+}
+
+int inode_get_mode(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->mode;
+}
+
+void inode_set_mode(inode_t *nodep, int mode)
+{
+  assert(nodep);
+
+  nodep->mode = mode;
+}
+
+bool_t inode_is_dir(inode_t *nodep)
+{
+  assert(nodep);
+
+  return (nodep->mode & S_IFMT) == INODE_DIR;
+}
+
+bool_t inode_is_inline(inode_t *nodep)
+{
+  assert(nodep);
+
+  return (nodep->flags & INODE_FLAG_INLINE) != 0;
+}
+
+const void *inode_inline_data(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Return NULL if the data is in blocks instead.
+  return inode_is_inline(nodep) ? nodep->inline_data : NULL;
+}
+
+int inode_get_refs(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->refs;
+}
+
+int inode_add_refs(inode_t *nodep, int delta)
+{
+  assert(nodep);
+  assert(nodep->refs + delta >= 0);
+
+  // Return the new reference count so callers can tell when the last link is gone.
+  nodep->refs += delta;
+  return nodep->refs;
+}
+
+int inode_get_flags(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->flags;
+}
+
+void inode_set_flags(inode_t *nodep, int flags)
+{
+  assert(nodep);
+
+  nodep->flags = flags;
+}
+
+unsigned int inode_get_generation(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->generation;
+}
+
+off_t inode_total_size(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->size;
+}
+
+int64_t inode_get_sectors(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Count 512 byte sectors like stat() does, so that tail fragments smaller than a block show up.
+  int64_t bytes = (nodep->blocks << BLOCK_SHIFT) + ((int64_t) nodep->tail_frags << FRAG_SHIFT);
+  return (bytes + 511) >> 9;
+}
+
+struct timespec inode_get_atime(inode_t *nodep)
+{
+  assert(nodep);
+
+  return inode_unpack_time(nodep->atime);
+}
+
+struct timespec inode_get_mtime(inode_t *nodep)
+{
+  assert(nodep);
+
+  return inode_unpack_time(nodep->mtime);
+}
+
+struct timespec inode_get_ctime(inode_t *nodep)
+{
+  assert(nodep);
+
+  return inode_unpack_time(nodep->ctime);
+}
+
+void inode_set_atime(inode_t *nodep, struct timespec ts)
+{
+  assert(nodep);
+
+  nodep->atime = inode_pack_time(ts);
+}
+
+void inode_set_mtime(inode_t *nodep, struct timespec ts)
+{
+  assert(nodep);
+
+  nodep->mtime = inode_pack_time(ts);
+}
+
+void inode_set_ctime(inode_t *nodep, struct timespec ts)
+{
+  assert(nodep);
+
+  nodep->ctime = inode_pack_time(ts);
+}
+
+void inode_touch(inode_t *nodep, int times)
+{
+  assert(nodep);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t ns = inode_pack_time(now);
+
+  if (times & INODE_ATIME)
+  {
+    nodep->atime = ns;
+  }
+
+  if (times & INODE_MTIME)
+  {
+    nodep->mtime = ns;
+  }
+
+  if (times & INODE_CTIME)
+  {
+    nodep->ctime = ns;
+  }
+}
+
+void inode_touch_atime(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Most reads leave the inode alone, so reading a file doesn't dirty the block holding its inode.
+  // The access time still shows whether the file was read since it was last written.
+  if (nodep->atime > nodep->mtime && nodep->atime > nodep->ctime)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (inode_pack_time(now) - nodep->atime < (int64_t) INODE_ATIME_INTERVAL * 1000000000)
+    {
+      return;
+    }
+  }
+
+  inode_touch(nodep, INODE_ATIME);
+}
+
+int inode_get_index(inode_t *nodep)
+{
+  assert(nodep);
+
+  return nodep->index_inum;
+}
+
+void inode_set_index(inode_t *nodep, int index_inum)
+{
+  assert(nodep);
+
+  nodep->index_inum = index_inum;
+}
+
+// Files and symbolic links are counted in the recursive totals of a single directory, even if they
+// have several links. Only linked inodes have one, so the field is shared with the orphan list.
+int inode_get_parent(inode_t *nodep)
+{
+  assert(nodep);
+  assert(!inode_is_dir(nodep));
+
+  return nodep->refs > 0 ? nodep->parent_inum : -1;
+}
+
+void inode_set_parent(inode_t *nodep, int parent_inum)
+{
+  assert(nodep);
+  assert(!inode_is_dir(nodep));
+
+  nodep->parent_inum = parent_inum;
+}
+
+// Get a pointer to the extent with the given index, whether it lives in the inode or in a leaf.
+extent_t *inode_extent(inode_t *nodep, int extent_num)
+{
+  assert(nodep);
+  assert(extent_num >= 0);
+
+  if (extent_num < INODE_LOCAL_EXTENT_CAP)
+  {
+    return &nodep->extents[extent_num];
+  }
+
+  // Find the leaf holding the extent through the index block.
+  extent_num -= INODE_LOCAL_EXTENT_CAP;
+  int *indexp = block_get(nodep->extent_bnum);
+  extent_t *leafp = block_get(indexp[extent_num / EXTENT_LEAF_CAP]);
+
+  return &leafp[extent_num % EXTENT_LEAF_CAP];
+}
+
+// Get the number of file blocks covered by the extents of the inode.
+int inode_mapped_blocks(inode_t *nodep)
+{
+  assert(nodep);
+
+  if (nodep->extent_count == 0)
+  {
+    return 0;
+  }
+
+  extent_t *lastp = inode_extent(nodep, nodep->extent_count - 1);
+  return lastp->fbnum + lastp->count;
+}
+
+// Append a new extent to the end of the extent list, allocating leaf blocks as needed.
+int inode_extent_push(inode_t *nodep, int fbnum, int bnum)
+{
+  assert(nodep);
+
+  int extent_num = nodep->extent_count;
+
+  if (extent_num >= INODE_MAX_EXTENTS)
+  {
+    return -EFBIG;
+  }
+
+  // Extents past the local ones need the index block and possibly a fresh leaf.
+  if (extent_num >= INODE_LOCAL_EXTENT_CAP)
+  {
+    int leaf_num = (extent_num - INODE_LOCAL_EXTENT_CAP) / EXTENT_LEAF_CAP;
+    int rv;
+
+    if (nodep->extent_bnum < 0)
+    {
+      if ((rv = block_alloc()) < 0)
+      {
+        return rv;
+      }
+
+      nodep->extent_bnum = rv;
+      nodep->blocks++;
+    }
+
+    // The first extent of every leaf needs a new leaf block.
+    if ((extent_num - INODE_LOCAL_EXTENT_CAP) % EXTENT_LEAF_CAP == 0)
+    {
+      if ((rv = block_alloc()) < 0)
+      {
+        // Don't leave an empty index block behind.
+        if (leaf_num == 0)
+        {
+          block_free(nodep->extent_bnum);
+          nodep->extent_bnum = -1;
+          nodep->blocks--;
+        }
+
+        return rv;
+      }
+
+      ((int *) block_get(nodep->extent_bnum))[leaf_num] = rv;
+      nodep->blocks++;
+    }
+  }
+
+  extent_t *extp = inode_extent(nodep, extent_num);
+  extp->fbnum = fbnum;
+  extp->bnum = bnum;
+  extp->count = 1;
+  nodep->extent_count++;
+
+  return 0;
+}
+
+// Remove the last extent from the extent list, freeing leaf blocks once they are empty.
+void inode_extent_pop(inode_t *nodep)
+{
+  assert(nodep);
+  assert(nodep->extent_count > 0);
+
+  int extent_num = --nodep->extent_count;
+
+  if (extent_num < INODE_LOCAL_EXTENT_CAP)
+  {
+    return;
+  }
+
+  // If this was the first extent of its leaf, the leaf is now empty.
+  if ((extent_num - INODE_LOCAL_EXTENT_CAP) % EXTENT_LEAF_CAP == 0)
+  {
+    int leaf_num = (extent_num - INODE_LOCAL_EXTENT_CAP) / EXTENT_LEAF_CAP;
+    block_free(((int *) block_get(nodep->extent_bnum))[leaf_num]);
+    nodep->blocks--;
+
+    // If this was the first leaf, the index block is now empty too.
+    if (leaf_num == 0)
+    {
+      block_free(nodep->extent_bnum);
+      nodep->extent_bnum = -1;
+      nodep->blocks--;
+    }
+  }
+}
+
+// Check whether the given extent is the last one starting at or before the given file block.
+bool_t inode_extent_is_last_before(inode_t *nodep, int extent_num, int file_bnum)
+{
+  return extent_num < nodep->extent_count && inode_extent(nodep, extent_num)->fbnum <= file_bnum
+         && (extent_num + 1 == nodep->extent_count
+             || inode_extent(nodep, extent_num + 1)->fbnum > file_bnum);
+}
+
+// Find the last extent starting at or before the given file block, or -1 if there is none.
+int inode_extent_find(inode_t *nodep, int file_bnum)
+{
+  assert(nodep);
+
+  // Inodes never move while the image is mounted, so their address picks the hint.
+  inode_map_hint_t *hintp = &map_hints[((uintptr_t) nodep / sizeof(inode_t)) & (INODE_MAP_HINTS - 1)];
+
+  if (hintp->nodep == nodep)
+  {
+    if (inode_extent_is_last_before(nodep, hintp->extent_num, file_bnum))
+    {
+      return hintp->extent_num;
+    }
+
+    if (inode_extent_is_last_before(nodep, hintp->extent_num + 1, file_bnum))
+    {
+      return ++hintp->extent_num;
+    }
+  }
+
+  int low = 0;
+  int high = nodep->extent_count - 1;
+
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+
+    if (inode_extent(nodep, mid)->fbnum <= file_bnum)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid - 1;
+    }
+  }
+
+  if (high >= 0)
+  {
+    hintp->nodep = nodep;
+    hintp->extent_num = high;
+  }
+
+  return high;
+}
+
+// Insert an extent at the given index, moving every extent after it up by one.
+int inode_extent_insert(inode_t *nodep, int extent_num, extent_t extent)
+{
+  assert(nodep);
+  assert(extent_num >= 0 && extent_num <= nodep->extent_count);
+
+  // Make room at the end first, which allocates a leaf block if one is needed.
+  int rv = inode_extent_push(nodep, extent.fbnum, extent.bnum);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  for (int i = nodep->extent_count - 1; i > extent_num; i--)
+  {
+    *inode_extent(nodep, i) = *inode_extent(nodep, i - 1);
+  }
+
+  *inode_extent(nodep, extent_num) = extent;
+  return 0;
+}
+
+// Remove the extent at the given index, moving every extent after it down by one.
+void inode_extent_remove(inode_t *nodep, int extent_num)
+{
+  assert(nodep);
+  assert(extent_num >= 0 && extent_num < nodep->extent_count);
+
+  for (int i = extent_num; i < nodep->extent_count - 1; i++)
+  {
+    *inode_extent(nodep, i) = *inode_extent(nodep, i + 1);
+  }
+
+  inode_extent_pop(nodep);
+}
+
+// Merge the extent at the given index with the one after it if they are contiguous both in the file
+// and on disk and both are written or unwritten.
+void inode_extent_merge(inode_t *nodep, int extent_num)
+{
+  assert(nodep);
+
+  if (extent_num < 0 || extent_num + 1 >= nodep->extent_count)
+  {
+    return;
+  }
+
+  extent_t *extp = inode_extent(nodep, extent_num);
+  extent_t *nextp = inode_extent(nodep, extent_num + 1);
+
+  if (extp->fbnum + extp->count == nextp->fbnum && extp->bnum + extp->count == nextp->bnum
+      && extp->unwritten == nextp->unwritten)
+  {
+    extp->count += nextp->count;
+    inode_extent_remove(nodep, extent_num + 1);
+  }
+}
+
+// Split the extent covering the given file block, if any, so that an extent starts at it.
+int inode_extent_split(inode_t *nodep, int file_bnum)
+{
+  assert(nodep);
+
+  int extent_num = inode_extent_find(nodep, file_bnum);
+
+  if (extent_num < 0)
+  {
+    return 0;
+  }
+
+  extent_t *extp = inode_extent(nodep, extent_num);
+  int offset = file_bnum - extp->fbnum;
+
+  if (offset == 0 || offset >= extp->count)
+  {
+    return 0;
+  }
+
+  extent_t rest = *extp;
+  rest.fbnum += offset;
+  rest.bnum += offset;
+  rest.count -= offset;
+  int rv = inode_extent_insert(nodep, extent_num + 1, rest);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  inode_extent(nodep, extent_num)->count = offset;
+  return 0;
+}
+
+// Mark the mapped blocks among the file blocks from first up to (but not including) last as written
+// or unwritten.
+int inode_set_unwritten(inode_t *nodep, int first, int last, bool_t unwritten)
+{
+  assert(nodep);
+
+  // Split the extents at either end so the range starts and ends on extent boundaries.
+  int rv = inode_extent_split(nodep, first);
+
+  if (rv < 0 || (rv = inode_extent_split(nodep, last)) < 0)
+  {
+    return rv;
+  }
+
+  int start_num = inode_extent_find(nodep, first);
+
+  if (start_num < 0 || inode_extent(nodep, start_num)->fbnum < first)
+  {
+    start_num++;
+  }
+
+  int end_num = start_num;
+
+  for (; end_num < nodep->extent_count && inode_extent(nodep, end_num)->fbnum < last; end_num++)
+  {
+    inode_extent(nodep, end_num)->unwritten = unwritten;
+  }
+
+  // Merge everything in the range and its neighbours back together where possible, from the back
+  // so that the indices still to be visited don't change.
+  for (int extent_num = end_num - 1; extent_num >= start_num - 1; extent_num--)
+  {
+    inode_extent_merge(nodep, extent_num);
+  }
+
+  return 0;
+}
+
+// Map the given run of disk blocks to the run of unmapped file blocks starting at fbnum, joining
+// it onto the neighbouring extents where it is contiguous with them.
+int inode_map_run(inode_t *nodep, int fbnum, int bnum, int count, bool_t unwritten)
+{
+  assert(nodep);
+
+  int prev_num = inode_extent_find(nodep, fbnum);
+  extent_t extent = {fbnum, bnum, count, unwritten};
+  int rv = inode_extent_insert(nodep, prev_num + 1, extent);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  inode_extent_merge(nodep, prev_num + 1);
+  inode_extent_merge(nodep, prev_num);
+
+  nodep->blocks += count;
+  return 0;
+}
+
+// Allocate a block for the given unmapped file block and map it. The block is allocated right
+// after the previous block of the file (or right before the next one) when possible, so that the
+// mapping stays a few long extents.
+int inode_map_block(inode_t *nodep, int file_bnum, bool_t unwritten)
+{
+  assert(nodep);
+
+  int prev_num = inode_extent_find(nodep, file_bnum);
+  extent_t *prevp = prev_num >= 0 ? inode_extent(nodep, prev_num) : NULL;
+  extent_t *nextp = prev_num + 1 < nodep->extent_count ? inode_extent(nodep, prev_num + 1) : NULL;
+  assert(!prevp || file_bnum >= prevp->fbnum + prevp->count);
+
+  // Aim for the disk block that would keep the file contiguous.
+  int bnum;
+
+  if (prevp)
+  {
+    bnum = block_alloc_near(prevp->bnum + (file_bnum - prevp->fbnum));
+  }
+  else if (nextp)
+  {
+    bnum = block_alloc_near(nextp->bnum - (nextp->fbnum - file_bnum));
+  }
+  else
+  {
+    bnum = block_alloc();
+  }
+
+  if (bnum < 0)
+  {
+    return bnum;
+  }
+
+  // Appending to the last extent is by far the most common case, so it skips the insert.
+  if (prevp && !nextp && prevp->unwritten == unwritten && prevp->fbnum + prevp->count == file_bnum
+      && prevp->bnum + prevp->count == bnum)
+  {
+    prevp->count++;
+    nodep->blocks++;
+    return bnum;
+  }
+
+  int rv = inode_map_run(nodep, file_bnum, bnum, 1, unwritten);
+
+  if (rv < 0)
+  {
+    block_free(bnum);
+    return rv;
+  }
+
+  return bnum;
+}
+
+// Free the blocks mapped to the file blocks from first up to (but not including) last, leaving a
+// hole in their place.
+int inode_unmap_blocks(inode_t *nodep, int first, int last)
+{
+  assert(nodep);
+  assert(first <= last);
+
+  // Start at the extent holding the first block, or the one after the hole it is in.
+  int extent_num = inode_extent_find(nodep, first);
+
+  if (extent_num < 0 || inode_extent(nodep, extent_num)->fbnum
+                        + inode_extent(nodep, extent_num)->count <= first)
+  {
+    extent_num++;
+  }
+
+  while (extent_num < nodep->extent_count)
+  {
+    extent_t *extp = inode_extent(nodep, extent_num);
+    int extent_end = extp->fbnum + extp->count;
+
+    if (extp->fbnum >= last)
+    {
+      break;
+    }
+
+    // Work out which part of the extent is cut out.
+    int cut_start = MAX(first, extp->fbnum);
+    int cut_end = MIN(last, extent_end);
+    int cut_bnum = extp->bnum + (cut_start - extp->fbnum);
+
+    // A hole in the middle of the extent splits it in two. Nothing is freed unless that works.
+    if (cut_start > extp->fbnum && cut_end < extent_end)
+    {
+      extent_t rest = *extp;
+      rest.fbnum = cut_end;
+      rest.bnum += cut_end - extp->fbnum;
+      rest.count = extent_end - cut_end;
+      int rv = inode_extent_insert(nodep, extent_num + 1, rest);
+
+      if (rv < 0)
+      {
+        return rv;
+      }
+
+      extp = inode_extent(nodep, extent_num);
+      extp->count = cut_start - extp->fbnum;
+      extent_num++;
+    }
+    else if (cut_start > extp->fbnum)
+    {
+      extp->count = cut_start - extp->fbnum;
+      extent_num++;
+    }
+    else if (cut_end < extent_end)
+    {
+      extp->bnum += cut_end - extp->fbnum;
+      extp->count = extent_end - cut_end;
+      extp->fbnum = cut_end;
+      extent_num++;
+    }
+    else
+    {
+      inode_extent_remove(nodep, extent_num);
+    }
+
+    for (int bnum = cut_bnum; bnum < cut_bnum + (cut_end - cut_start); bnum++)
+    {
+      block_free(bnum);
+    }
+
+    nodep->blocks -= cut_end - cut_start;
+  }
+
+  return 0;
+}
+
+// Free the last mapped block of the inode.
+void inode_drop_block(inode_t *nodep)
+{
+  assert(nodep);
+  assert(nodep->extent_count > 0);
+
+  extent_t *lastp = inode_extent(nodep, nodep->extent_count - 1);
+  block_free(lastp->bnum + lastp->count - 1);
+  nodep->blocks--;
+
+  // Drop the extent entirely once its last block is gone.
+  if (--lastp->count == 0)
+  {
+    inode_extent_pop(nodep);
+  }
+}
+
+// Get the number of fragments needed for a tail of the given number of bytes.
+int inode_tail_frags(int bytes)
+{
+  return (bytes + FRAG_MASK) >> FRAG_SHIFT;
+}
+
+// Get a pointer to the data of the given file block, which may be the tail, a hole or an unwritten
+// block. The data of a hole or an unwritten block must not be written to.
+void *inode_block_data(inode_t *nodep, int file_bnum)
+{
+  assert(nodep);
+
+  if (nodep->tail_bnum >= 0 && file_bnum == nodep->size >> BLOCK_SHIFT)
+  {
+    return block_get(nodep->tail_bnum) + (nodep->tail_frag << FRAG_SHIFT);
+  }
+
+  int extent_num = inode_extent_find(nodep, file_bnum);
+  extent_t *extp = extent_num >= 0 ? inode_extent(nodep, extent_num) : NULL;
+
+  if (!extp || file_bnum >= extp->fbnum + extp->count || extp->unwritten)
+  {
+    return zero_block;
+  }
+
+  return block_get(extp->bnum + (file_bnum - extp->fbnum));
+}
+
+// Zero the parts of the given block that lie outside the range from offset up to end, which the
+// caller is about to write.
+void inode_zero_outside(void *datap, off_t block_start, off_t offset, off_t end)
+{
+  if (offset > block_start)
+  {
+    memset(datap, 0, MIN(offset - block_start, BLOCK_SIZE));
+  }
+
+  if (end < block_start + BLOCK_SIZE)
+  {
+    off_t zero_start = MAX(end - block_start, 0);
+    memset(datap + zero_start, 0, BLOCK_SIZE - zero_start);
+  }
+}
+
+// Zero the given bytes of the file, which must all lie within one block, unless they are in a hole.
+void inode_zero_within_block(inode_t *nodep, off_t offset, int size)
+{
+  assert(nodep);
+
+  void *datap = inode_block_data(nodep, offset >> BLOCK_SHIFT);
+
+  if (size > 0 && datap != zero_block)
+  {
+    memset(datap + (offset & BLOCK_MASK), 0, size);
+  }
+}
+
+// Free the tail fragments of the inode.
+void inode_free_tail(inode_t *nodep)
+{
+  assert(nodep);
+  assert(nodep->tail_bnum >= 0);
+
+  block_free_frags(nodep->tail_bnum, nodep->tail_frag, nodep->tail_frags);
+  nodep->tail_bnum = -1;
+  nodep->tail_frag = 0;
+  nodep->tail_frags = 0;
+}
+
+// Move the tail of the inode out of its fragments and into a full block of its own.
+int inode_unpack_tail(inode_t *nodep)
+{
+  assert(nodep);
+  assert(nodep->tail_bnum >= 0);
+
+  int file_bnum = nodep->size >> BLOCK_SHIFT;
+  int tail_size = nodep->size & BLOCK_MASK;
+  void *tailp = inode_block_data(nodep, file_bnum);
+  int bnum = inode_map_block(nodep, file_bnum, FALSE);
+
+  if (bnum < 0)
+  {
+    return bnum;
+  }
+
+  // The rest of the block is past the end of the file and has to read back as zeroes.
+  memcpy(block_get(bnum), tailp, tail_size);
+  memset(block_get(bnum) + tail_size, 0, BLOCK_SIZE - tail_size);
+  inode_free_tail(nodep);
+
+  return 0;
+}
+
+int inode_pack_tail(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Only the last block of a regular file that is in a block of its own can be packed.
+  int tail_size = nodep->size & BLOCK_MASK;
+
+  if (!S_ISREG(nodep->mode) || inode_is_inline(nodep) || nodep->tail_bnum >= 0 || tail_size == 0)
+  {
+    return 0;
+  }
+
+  // A tail that would need every fragment of a block is no smaller than the block itself, and a
+  // tail in a hole or an unwritten block takes no space at all. Blocks preallocated past the end of
+  // the file stay where they are, so the tail isn't packed while there are any.
+  int frags = inode_tail_frags(tail_size);
+  int file_bnum = nodep->size >> BLOCK_SHIFT;
+
+  if (frags >= BLOCK_FRAGS || inode_mapped_blocks(nodep) != file_bnum + 1
+      || inode_block_data(nodep, file_bnum) == zero_block)
+  {
+    return 0;
+  }
+
+  int frag;
+  int bnum = block_alloc_frags(frags, &frag);
+
+  // Packing only saves space, so on a full image the tail just stays in its block.
+  if (bnum < 0)
+  {
+    return bnum == -ENOSPC ? 0 : bnum;
+  }
+
+  // Copy the tail over, keeping the rest of the fragments zeroed, and give back the block it used
+  // to live in.
+  void *tailp = block_get(bnum) + (frag << FRAG_SHIFT);
+  memset(tailp, 0, frags << FRAG_SHIFT);
+  memcpy(tailp, block_get(inode_get_bnum(nodep, file_bnum)), tail_size);
+  inode_drop_block(nodep);
+
+  nodep->tail_bnum = bnum;
+  nodep->tail_frag = frag;
+  nodep->tail_frags = frags;
+
+  return 0;
+}
+
+int inode_alloc(void)
+{
+  return inode_alloc_near(-1);
+}
+
+int inode_alloc_near(int goal_inum)
+{
+  superblock_t *sbp = block_superblock();
+  int group_num = -1;
+
+  // Keep the inode in the same group as the goal (usually its parent directory) when possible so
+  // related inodes share table blocks.
+  if (goal_inum >= 0 && goal_inum < block_inode_count()
+      && inode_group(goal_inum / INODE_GROUP_SIZE)->free_count > 0)
+  {
+    group_num = goal_inum / INODE_GROUP_SIZE;
+  }
+
+  // Otherwise take the lowest group with a free inode, skipping the groups known to be full.
+  while (group_num < 0 && group_hint < sbp->inode_group_count)
+  {
+    if (inode_group(group_hint)->free_count > 0)
+    {
+      group_num = group_hint;
+    }
+    else
+    {
+      group_hint++;
+    }
+  }
+
+  // Grow the table by a group once every existing group is full.
+  if (group_num < 0 && (group_num = inode_group_add()) < 0)
+  {
+    // Return -ENOSPC indicating that there is no space to store more inodes.
+    return -ENOSPC;
+  }
+
+  // Search the group bitmap for its first free inode.
+  inode_group_t *groupp = inode_group(group_num);
+  int index = bitmap_find_zero(groupp->bitmap, 0, INODE_GROUP_SIZE);
+  assert(index >= 0);
+
+  int inum = group_num * INODE_GROUP_SIZE + index;
+
+  // Freed inodes keep their old contents, so the generation carries over and is bumped to tell the
+  // new file apart from whatever used the inode number before.
+  inode_t *nodep = inode_slot(inum);
+  unsigned int generation = nodep->generation + 1;
+  inode_reset(nodep);
+  nodep->generation = generation;
+
+  bitmap_put(groupp->bitmap, index, 1);
+  groupp->free_count--;
+
+  printf("inode_alloc() -> %d\n", inum);
+
+  return inum;
+}
+
+int inode_free(int inum)
+{
+  assert(inum < block_inode_count());
+  assert(inode_exists(inum));
+
+  inode_t *nodep = inode_get(inum);
+
+  // Free the directory index along with the directory.
+  if (inode_is_dir(nodep) && nodep->index_inum >= 0)
+  {
+    inode_free(nodep->index_inum);
+    nodep->index_inum = -1;
+  }
+
+  // Clear all content from the node before freeing it.
+  int rv = inode_clear(nodep);
+
+  // Return any error that may have developed.
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Set the inode to unused.
+  int group_num = inum / INODE_GROUP_SIZE;
+  inode_group_t *groupp = inode_group(group_num);
+  bitmap_put(groupp->bitmap, inum % INODE_GROUP_SIZE, 0);
+  groupp->free_count++;
+  group_hint = MIN(group_hint, group_num);
+
+  printf("inode_free(%d)\n", inum);
+  return 0;
+}
+
+int inode_clear(inode_t *nodep)
+{
+  // Shrinl to a size of 0.
+  int rv = inode_shrink(nodep, inode_total_size(nodep));
+  assert(nodep->size == 0);
+  assert(nodep->blocks == 0);
+  assert(nodep->tail_bnum < 0);
+  return rv;
+}
+
+// Move the inline data of the inode out into its first block.
+int inode_spill_inline(inode_t *nodep)
+{
+  assert(nodep);
+  assert(inode_is_inline(nodep));
+
+  // The extents share their space with the inline data, so save the data first.
+  byte_t data[INODE_INLINE_CAP];
+  int size = nodep->size;
+  memcpy(data, nodep->inline_data, size);
+
+  nodep->flags &= ~INODE_FLAG_INLINE;
+  memset(nodep->extents, -1, sizeof(extent_t) * INODE_LOCAL_EXTENT_CAP);
+
+  int bnum = inode_map_block(nodep, 0, FALSE);
+
+  // Put the data back inline if no block could be allocated, with the unused bytes zeroed again.
+  if (bnum < 0)
+  {
+    memset(nodep->inline_data, 0, INODE_INLINE_CAP);
+    memcpy(nodep->inline_data, data, size);
+    nodep->flags |= INODE_FLAG_INLINE;
+    return bnum;
+  }
+
+  memcpy(block_get(bnum), data, size);
+  memset(block_get(bnum) + size, 0, BLOCK_SIZE - size);
+  return 0;
+}
+
+int inode_grow_sparse(inode_t *nodep, off_t size)
+{
+  assert(nodep);
+
+  // For a growth size of less than 1, return 0 and do nothing.
+  if (size < 1)
+  {
+    return 0;
+  }
+
+  // An empty regular file or symbolic link small enough to stay inline doesn't need any blocks. The
+  // unused inline bytes are kept zeroed, so the new bytes read back as zeroes. An empty file with
+  // preallocated blocks keeps using them instead.
+  if (nodep->size == 0 && nodep->extent_count == 0 && (S_ISREG(nodep->mode) || S_ISLNK(nodep->mode))
+      && size <= INODE_INLINE_CAP)
+  {
+    memset(nodep->inline_data, 0, INODE_INLINE_CAP);
+    nodep->flags |= INODE_FLAG_INLINE;
+  }
+
+  if (inode_is_inline(nodep))
+  {
+    if (nodep->size + size <= INODE_INLINE_CAP)
+    {
+      nodep->size += size;
+      return 0;
+    }
+
+    // The file outgrew the inode, so it continues in blocks.
+    int rv = inode_spill_inline(nodep);
 
-inode_t *inode_get(int inum)
-{
-  assert(inum < MAX_INODE_COUNT);
-  assert(inode_exists(inum));
+    if (rv < 0)
+    {
+      return rv;
+    }
+  }
 
-  // Return the proper inode at the given offset.
-  return block_inode_start() + (sizeof(inode_t) * inum);
-}
+  off_t new_size = nodep->size + size;
 
-void inode_reset(inode_t *nodep)
-{
-  assert(nodep);
+  if (nodep->tail_bnum >= 0)
+  {
+    // A tail that still holds the new end of the file only has to grow by a few fragments, if
+    // they are free. The new fragments are zeroed like the rest of the tail past the end.
+    int frags = inode_tail_frags(((new_size - 1) & BLOCK_MASK) + 1);
+
+    if ((new_size - 1) >> BLOCK_SHIFT == nodep->size >> BLOCK_SHIFT && frags < BLOCK_FRAGS
+        && nodep->tail_frag + frags <= BLOCK_FRAGS
+        && (frags <= nodep->tail_frags
+            || block_extend_frags(nodep->tail_bnum, nodep->tail_frag, nodep->tail_frags,
+                                  frags) == 0))
+    {
+      if (frags > nodep->tail_frags)
+      {
+        memset(block_get(nodep->tail_bnum) + ((nodep->tail_frag + nodep->tail_frags) << FRAG_SHIFT),
+               0, (frags - nodep->tail_frags) << FRAG_SHIFT);
+        nodep->tail_frags = frags;
+      }
+
+      nodep->size = new_size;
+      return 0;
+    }
 
-  nodep->refs = 0;
-  nodep->mode = 0100644;
-  nodep->size = 0;
-  memset(nodep->blocks, -1, sizeof(int) * INODE_LOCAL_BLOCK_CAP);
-  nodep->next = -1;
+    // Otherwise the tail becomes a full block again.
+    int rv = inode_unpack_tail(nodep);
+
+    if (rv < 0)
+    {
+      return rv;
+    }
+  }
+
+  // The bytes past the old end of the file are already zero and everything after its last block is
+  // a hole, so only the size has to change.
+  nodep->size = new_size;
+  return 0;
 }
 
-int inode_total_size(inode_t *nodep)
+off_t inode_map_range(inode_t *nodep, off_t offset, off_t size)
 {
   assert(nodep);
+  assert(offset >= 0);
 
-  int size = nodep->size;
+  // Inline data needs no blocks.
+  if (size < 1 || inode_is_inline(nodep))
+  {
+    return MAX(size, 0);
+  }
+
+  off_t end = offset + size;
+  int first_bnum = offset >> BLOCK_SHIFT;
+  int last_bnum = (end - 1) >> BLOCK_SHIFT;
+
+  // The tail block is backed by its fragments.
+  if (nodep->tail_bnum >= 0)
+  {
+    last_bnum = MIN(last_bnum, (nodep->size >> BLOCK_SHIFT) - 1);
+  }
+
+  int file_bnum = first_bnum;
 
-  if (nodep->next >= 0)
+  while (file_bnum <= last_bnum)
   {
-    size += inode_total_size(inode_get(nodep->next));
+    int extent_num = inode_extent_find(nodep, file_bnum);
+    extent_t *extp = extent_num >= 0 ? inode_extent(nodep, extent_num) : NULL;
+    int rv;
+
+    if (extp && file_bnum < extp->fbnum + extp->count)
+    {
+      // Written blocks are ready as they are. Unwritten ones become written, and as the caller
+      // writes the range itself only the parts of its first and last block outside it are zeroed.
+      int run_end = MIN(extp->fbnum + extp->count - 1, last_bnum);
+
+      if (extp->unwritten)
+      {
+        void *datap = block_get(extp->bnum + (file_bnum - extp->fbnum));
+        inode_zero_outside(datap, (off_t) file_bnum << BLOCK_SHIFT, offset, end);
+        datap = block_get(extp->bnum + (run_end - extp->fbnum));
+        inode_zero_outside(datap, (off_t) run_end << BLOCK_SHIFT, offset, end);
+
+        if ((rv = inode_set_unwritten(nodep, file_bnum, run_end + 1, FALSE)) < 0)
+        {
+          off_t mapped = ((off_t) file_bnum << BLOCK_SHIFT) - offset;
+          return mapped > 0 ? mapped : rv;
+        }
+      }
+
+      file_bnum = run_end + 1;
+      continue;
+    }
+
+    int bnum = inode_map_block(nodep, file_bnum, FALSE);
+
+    // If space runs out, report how much of the range is backed so far.
+    if (bnum < 0)
+    {
+      off_t mapped = ((off_t) file_bnum << BLOCK_SHIFT) - offset;
+      return mapped > 0 ? mapped : bnum;
+    }
+
+    // The caller writes the range itself, so only the rest of the block has to be zeroed.
+    inode_zero_outside(block_get(bnum), (off_t) file_bnum << BLOCK_SHIFT, offset, end);
+    file_bnum++;
   }
 
   return size;
 }
 
-inode_t *inode_last_child(inode_t *nodep)
+int inode_grow(inode_t *nodep, off_t size)
 {
   assert(nodep);
 
-  // Recursively follow the chain of inodes until the last one is found.
-  return nodep->next < 0 ? nodep : inode_last_child(inode_get(nodep->next));
-}
+  off_t start_size = inode_total_size(nodep);
+  int rv = inode_grow_sparse(nodep, size);
 
-inode_t *inode_second_to_last_child(inode_t *nodep)
-{
-  assert(nodep);
-  assert(nodep->next >= 0);
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Back every new byte with a block right away, taking back speculative preallocations if space
+  // runs out.
+  off_t mapped = inode_map_range(nodep, start_size, size);
 
-  inode_t *nextp = inode_get(nodep->next);
+  if (mapped < size && inode_trim_all_prealloc())
+  {
+    mapped = inode_map_range(nodep, start_size, size);
+  }
 
-  if (nextp->next < 0)
+  if (mapped < size)
   {
-    return nodep;
+    inode_shrink(nodep, size);
+    return mapped < 0 ? (int) mapped : -ENOSPC;
   }
 
-  return inode_second_to_last_child(nextp);
+  return 0;
 }
 
-int inode_alloc(void)
+int inode_shrink(inode_t *nodep, off_t size)
 {
-  void *inode_bitmap = block_inode_bitmap_start();
-  inode_t *nodep;
+  assert(nodep);
 
-  // Search for the first available inode in the bitmap. If a free inode is found then reset its
-  // values.
-  for (int inum = 0; inum < MAX_INODE_COUNT; inum++)
+  // For a negative shrink size, return 0 and do nothing. Shrinking by 0 still frees any blocks
+  // preallocated past the end of the file.
+  if (size < 0)
   {
-    if (!bitmap_get(inode_bitmap, inum))
-    {
-      nodep = block_inode_start() + (sizeof(inode_t) * inum);
-      inode_reset(nodep);
-      bitmap_put(inode_bitmap, inum, 1);
+    return 0;
+  }
+
+  // Never shrink below an empty file.
+  size = MIN(size, nodep->size);
+  off_t old_size = nodep->size;
+  nodep->size -= size;
 
-      printf("inode_alloc() -> %d\n", inum);
-      inode_print_bitmap();
+  // Inline data has no blocks to free, but the cut off bytes are zeroed so that growing the file
+  // again reads back zeroes.
+  if (inode_is_inline(nodep))
+  {
+    memset(nodep->inline_data + nodep->size, 0, size);
 
-      return inum;
+    // An empty file can pick between inline data and blocks again when it next grows.
+    if (nodep->size == 0)
+    {
+      nodep->flags &= ~INODE_FLAG_INLINE;
+      memset(nodep->extents, -1, sizeof(extent_t) * INODE_LOCAL_EXTENT_CAP);
     }
+
+    return 0;
   }
 
-  // Return -ENOSPC indicating that there is no space to store more inodes.
-  return -ENOSPC;
-}
+  if (nodep->tail_bnum >= 0)
+  {
+    // Keep the tail if the new end of the file is still inside it, giving back the fragments that
+    // are no longer needed and zeroing the cut off bytes. Otherwise the tail goes before any of the
+    // blocks.
+    int tail_size = nodep->size & BLOCK_MASK;
+    int frags = inode_tail_frags(tail_size);
 
-int inode_free(int inum)
-{
-  assert(inum < MAX_INODE_COUNT);
-  assert(inode_exists(inum));
+    if (nodep->size >> BLOCK_SHIFT == old_size >> BLOCK_SHIFT && frags > 0)
+    {
+      if (frags < nodep->tail_frags)
+      {
+        block_free_frags(nodep->tail_bnum, nodep->tail_frag + frags, nodep->tail_frags - frags);
+        nodep->tail_frags = frags;
+      }
+
+      memset(inode_block_data(nodep, nodep->size >> BLOCK_SHIFT) + tail_size, 0,
+             (frags << FRAG_SHIFT) - tail_size);
+      return 0;
+    }
 
-  // Clear all content from the node before freeing it.
-  int rv = inode_clear(inode_get(inum));
+    inode_free_tail(nodep);
+  }
 
-  // Return any error that may have developed.
-  if (rv < 0)
+  // Free every block past the new end of the file, which includes any preallocated ones.
+  int needed_blocks = bytes_to_blocks(nodep->size);
+
+  while (inode_mapped_blocks(nodep) > needed_blocks)
   {
-    return rv;
+    inode_drop_block(nodep);
   }
 
-  // Set the inode to unused.
-  bitmap_put(block_inode_bitmap_start(), inum, 0);
+  inode_forget_prealloc(nodep);
 
-  printf("inode_free(%d)\n", inum);
-  inode_print_bitmap();
-}
+  // The bytes past the new end of its last block are zeroed, so growing the file again reads back
+  // zeroes without having to touch them.
+  int last_size = nodep->size & BLOCK_MASK;
 
-int inode_clear(inode_t *nodep)
-{
-  // Shrinl to a size of 0.
-  int rv = inode_shrink(nodep, inode_total_size(nodep));
-  assert(nodep->size == 0);
-  return rv;
+  if (last_size > 0)
+  {
+    inode_zero_within_block(nodep, nodep->size, BLOCK_SIZE - last_size);
+  }
+
+  return 0;
 }
 
-int inode_grow(inode_t *nodep, int size)
+int inode_punch(inode_t *nodep, off_t offset, off_t size)
 {
   assert(nodep);
+  assert(offset >= 0);
+
+  // Only the part of the range inside the file matters.
+  size = MIN(size, nodep->size - offset);
 
-  // For a growth size of less than 1, return 0 and do nothing. This is a recursive base case.
   if (size < 1)
   {
     return 0;
   }
 
-  // Get the last child inode and see how many blocks it uses.
-  inode_t *last_childp = inode_last_child(nodep);
-  int last_child_used_blocks = bytes_to_blocks(last_childp->size);
+  off_t end = offset + size;
 
-  // This will be the particular single block being expanded by this recursive iteration. Note that
-  // each recursive iteration will only actually update one block before recurring to a separate
-  // block.
-  int bnum;
+  if (inode_is_inline(nodep))
+  {
+    memset(nodep->inline_data + offset, 0, size);
+    return 0;
+  }
+
+  // A range within a single block is zeroed, unless it covers all of it.
+  if (offset >> BLOCK_SHIFT == (end - 1) >> BLOCK_SHIFT && size < BLOCK_SIZE)
+  {
+    inode_zero_within_block(nodep, offset, size);
+    return 0;
+  }
 
-  // If no more blocks are needed simply increase the size.
-  if (bytes_to_blocks(last_childp->size + size) == last_child_used_blocks)
+  // Otherwise the blocks entirely inside the range are freed and the partial blocks at either end of
+  // it are zeroed. The tail is always partial.
+  int first_bnum = (offset + BLOCK_MASK) >> BLOCK_SHIFT;
+  int last_bnum = end >> BLOCK_SHIFT;
+  int rv = inode_unmap_blocks(nodep, first_bnum, last_bnum);
+
+  if (rv < 0)
   {
-    last_childp->size += size;
-    return size;
+    return rv;
   }
 
+  inode_zero_within_block(nodep, offset, ((off_t) first_bnum << BLOCK_SHIFT) - offset);
+  inode_zero_within_block(nodep, (off_t) last_bnum << BLOCK_SHIFT, end & BLOCK_MASK);
+
+  return 0;
+}
+
+// Back every hole among the bytes from offset up to end with unwritten blocks, even past the end of
+// the file.
+int inode_preallocate(inode_t *nodep, off_t offset, off_t end)
+{
+  assert(nodep);
+
   int rv;
 
-  // If a local slot exists put the new block into it.
-  if (last_child_used_blocks < INODE_LOCAL_BLOCK_CAP)
+  // Inline data is already backed by the inode itself, as long as the range fits in it.
+  if (inode_is_inline(nodep))
   {
-    // Allocate the new block.
-    bnum = block_alloc();
+    if (end <= INODE_INLINE_CAP)
+    {
+      return 0;
+    }
 
-    // Ensure no errors were thrown.
-    if (bnum < 0)
+    if ((rv = inode_spill_inline(nodep)) < 0)
+    {
+      return rv;
+    }
+  }
+
+  // Nothing can be mapped past a tail, so a range reaching it needs the tail in a block again.
+  if (nodep->tail_bnum >= 0 && end > (nodep->size & ~(off_t) BLOCK_MASK)
+      && (rv = inode_unpack_tail(nodep)) < 0)
+  {
+    return rv;
+  }
+
+  int file_bnum = offset >> BLOCK_SHIFT;
+  int last_bnum = (end - 1) >> BLOCK_SHIFT;
+
+  while (file_bnum <= last_bnum)
+  {
+    int extent_num = inode_extent_find(nodep, file_bnum);
+    extent_t *extp = extent_num >= 0 ? inode_extent(nodep, extent_num) : NULL;
+
+    // Skip over the blocks that are mapped already.
+    if (extp && file_bnum < extp->fbnum + extp->count)
     {
-      return bnum;
+      file_bnum = extp->fbnum + extp->count;
+      continue;
     }
 
-    last_childp->blocks[last_child_used_blocks] = bnum;
+    // The hole runs up to the next extent or the end of the range.
+    int hole_end = last_bnum + 1;
 
-    // Grow the last child's size by whatever this increment was.
-    last_childp->size += MIN(BLOCK_SIZE, size);
+    if (extent_num + 1 < nodep->extent_count)
+    {
+      hole_end = MIN(hole_end, inode_extent(nodep, extent_num + 1)->fbnum);
+    }
 
-    // Recursively grow the inode starting at the last child as a performance shortcut.
-    rv = inode_grow(last_childp, size - BLOCK_SIZE);
+    // Back as much of the hole as possible with one contiguous run, preferably one continuing the
+    // blocks before it. Settle for shorter runs when the free space is fragmented and for single
+    // blocks placed near the rest of the file last.
+    int count = hole_end - file_bnum;
+    int goal = extp ? extp->bnum + (file_bnum - extp->fbnum) : -1;
+    int bnum = -ENOSPC;
 
-    // Ensure no errors were thrown.
-    if (rv < 0)
+    while (count > 1 && (bnum = block_alloc_run_near(goal, count)) < 0)
+    {
+      count /= 2;
+    }
+
+    if (bnum < 0)
+    {
+      count = 1;
+
+      if ((bnum = inode_map_block(nodep, file_bnum, TRUE)) < 0)
+      {
+        return bnum;
+      }
+    }
+    else if ((rv = inode_map_run(nodep, file_bnum, bnum, count, TRUE)) < 0)
     {
+      for (int i = 0; i < count; i++)
+      {
+        block_free(bnum + i);
+      }
+
       return rv;
     }
 
-    // Return the size we successfully incremented by.
-    return size;
+    file_bnum += count;
   }
 
-  // At this point, we fill what we can into this last child and update the remaining size we must
-  // find a spot for.
-  int remaining_size_change = size - (INODE_MAX_LOCAL_SIZE - last_childp->size);
-  last_childp->size = INODE_MAX_LOCAL_SIZE;
+  return 0;
+}
 
-  // Since we know we are operating in the last child, we must create a new child.
-  int new_inum = inode_alloc();
+int inode_fallocate(inode_t *nodep, off_t offset, off_t size, bool_t keep_size)
+{
+  assert(nodep);
+  assert(offset >= 0);
 
-  // Ensure no errors were thrown.
-  if (new_inum < 0)
+  if (size < 1)
   {
-    return new_inum;
+    return 0;
   }
 
-  // Since there were no errors, add the new inum to the linked list.
-  last_childp->next = new_inum;
+  // Unless asked not to, the file grows to cover the range first. Blocks explicitly reserved past
+  // the end are kept until the file is truncated, so they are no longer speculative.
+  off_t start_size = nodep->size;
+  off_t end = offset + size;
+  int rv;
 
-  // Recursively perform the growth in this child inode with the remaining size.
-  rv = inode_grow(inode_get(last_childp->next), remaining_size_change);
+  if (keep_size && end > nodep->size)
+  {
+    inode_forget_prealloc(nodep);
+  }
 
-  // Ensure no errors were thrown.
-  if (rv < 0)
+  if (!keep_size && end > nodep->size && (rv = inode_grow_sparse(nodep, end - nodep->size)) < 0)
   {
     return rv;
   }
 
-  // Return the size.
-  return size;
+  // The blocks are allocated but left as they are, since unwritten blocks read back as zeroes.
+  // Running out of space leaves the file at its old size.
+  if ((rv = inode_preallocate(nodep, offset, end)) < 0)
+  {
+    if (nodep->size > start_size)
+    {
+      inode_shrink(nodep, nodep->size - start_size);
+    }
+
+    return rv;
+  }
+
+  return 0;
 }
 
-int inode_grow_zero(inode_t *nodep, int size)
+int inode_zero_range(inode_t *nodep, off_t offset, off_t size, bool_t keep_size)
 {
   assert(nodep);
-  
-  int start_size = inode_total_size(nodep);
-  int growth_size = inode_grow(nodep, size);
+  assert(offset >= 0);
 
-  if (growth_size < 0)
+  if (size < 1)
   {
-    return growth_size;
+    return 0;
   }
 
-  int rv = inode_fill(nodep, start_size, 0x0, growth_size);
+  // Allocate the range like fallocate does, so that only the blocks already holding data need any
+  // more work.
+  off_t end = offset + size;
+  int rv = inode_fallocate(nodep, offset, size, keep_size);
 
   if (rv < 0)
   {
     return rv;
   }
 
-  return growth_size;
+  if (inode_is_inline(nodep))
+  {
+    memset(nodep->inline_data + offset, 0, MAX(MIN(end, nodep->size) - offset, 0));
+    return 0;
+  }
+
+  // A range within a single block is zeroed, unless it covers all of it.
+  if (offset >> BLOCK_SHIFT == (end - 1) >> BLOCK_SHIFT && size < BLOCK_SIZE)
+  {
+    inode_zero_within_block(nodep, offset, size);
+    return 0;
+  }
+
+  // Otherwise the blocks entirely inside the range are marked unwritten rather than overwritten, and
+  // the partial blocks at either end of it are zeroed.
+  int first_bnum = (offset + BLOCK_MASK) >> BLOCK_SHIFT;
+  int last_bnum = end >> BLOCK_SHIFT;
+
+  if (first_bnum < last_bnum && (rv = inode_set_unwritten(nodep, first_bnum, last_bnum, TRUE)) < 0)
+  {
+    return rv;
+  }
+
+  inode_zero_within_block(nodep, offset, ((off_t) first_bnum << BLOCK_SHIFT) - offset);
+  inode_zero_within_block(nodep, (off_t) last_bnum << BLOCK_SHIFT, end & BLOCK_MASK);
+
+  return 0;
 }
 
-int inode_shrink(inode_t *nodep, int size)
+void inode_speculate(inode_t *nodep, off_t offset)
 {
   assert(nodep);
+  assert(offset >= 0);
 
-  // For a shrink size of less than 1 or a node size of 0, return 0 and do nothing. This is a
-  // recursive base case. Note that a node size of 0 can only occur at the very top level. All
-  // other nodes will be freed if their size ever reaches 0.
-  if (size < 1 || nodep->size == 0)
+  // Only a file that has outgrown its inode and its fragments and has been written for a while gets
+  // a reservation, and only once the last one is used up.
+  if (inode_is_inline(nodep) || nodep->tail_bnum >= 0 || nodep->size < INODE_PREALLOC_MIN
+      || inode_mapped_blocks(nodep) >= bytes_to_blocks(nodep->size))
   {
-    return 0;
+    return;
   }
 
-  // Get the last child inode and see how many blocks it uses.
-  inode_t *last_childp = inode_last_child(nodep);
-  int last_child_used_blocks = bytes_to_blocks(last_childp->size);
+  // Keep track of the file so that the reservation can be taken back later.
+  if (!(nodep->flags & INODE_FLAG_PREALLOC))
+  {
+    if (prealloc_count >= INODE_PREALLOC_FILES)
+    {
+      return;
+    }
+
+    prealloc_nodes[prealloc_count++] = nodep;
+    nodep->flags |= INODE_FLAG_PREALLOC;
+  }
+
+  // Reserve as much again as the file already holds, so the reservation doubles for as long as the
+  // writer keeps going, but never more than a small share of the image.
+  off_t reserve = MIN(nodep->size, INODE_PREALLOC_MAX);
+  reserve = MIN(reserve, ((off_t) block_total_count() << BLOCK_SHIFT) / 64);
+
+  // The range being written is allocated along with the reservation, so it lands in the same run.
+  // Failing only means the write allocates its own blocks one at a time.
+  inode_preallocate(nodep, offset, nodep->size + reserve);
+}
+
+void inode_forget_prealloc(inode_t *nodep)
+{
+  assert(nodep);
 
-  // If no fewer blocks are needed simply decrease the size.
-  if (bytes_to_blocks(last_childp->size - size) == last_child_used_blocks)
+  nodep->flags &= ~INODE_FLAG_PREALLOC;
+
+  for (int i = 0; i < prealloc_count; i++)
   {
-    last_childp->size -= size;
-    return size;
+    if (prealloc_nodes[i] == nodep)
+    {
+      prealloc_nodes[i] = prealloc_nodes[--prealloc_count];
+      break;
+    }
   }
+}
 
-  // Since we know the number of blocks will decrease we can free up the last block and mark that
-  // slot as unused.
-  block_free(last_childp->blocks[last_child_used_blocks - 1]);
-  last_childp->blocks[last_child_used_blocks - 1] = -1;
+int inode_trim_prealloc(inode_t *nodep)
+{
+  assert(nodep);
+
+  // Shrinking by nothing frees every block past the end of the file.
+  return nodep->flags & INODE_FLAG_PREALLOC ? inode_shrink(nodep, 0) : 0;
+}
 
-  // We must calculate carefully the decreased size and use it to further compute the remaining
-  // shrinkage that must occur as well as the new last child size.
-  int decrease_size = last_childp->size - (BLOCK_SIZE * (last_child_used_blocks - 1));
-  int remaining_size_change = size - decrease_size;
-  last_childp->size -= decrease_size;
+bool_t inode_trim_all_prealloc(void)
+{
+  bool_t trimmed = prealloc_count > 0;
 
-  // If the last child was shrunk all the way down to 0 (i.e. we took everything from the block in
-  // the first slot) we can deallocate it.
-  if (nodep->next >= 0 && last_childp->size == 0)
+  // Trimming a file drops it from the list.
+  while (prealloc_count > 0)
   {
-    inode_t *second_to_last_childp = inode_second_to_last_child(nodep);
-    inode_free(second_to_last_childp->next);
-    second_to_last_childp->next = -1;
+    inode_shrink(prealloc_nodes[prealloc_count - 1], 0);
   }
 
-  // Shrink any remaining size change that is needed.
-  inode_shrink(nodep, remaining_size_change);
+  return trimmed;
+}
 
-  return size;
+// Give back the reservations of files that still had one when nufs last stopped without unmounting.
+// The list of those files only lived in memory, so the flag is all that is left of it. Returns the
+// number of files trimmed.
+int inode_trim_stale_prealloc(void)
+{
+  int count = 0;
+
+  for (int inum = 0; inum < block_inode_count(); inum++)
+  {
+    if (inode_exists(inum) && (inode_get(inum)->flags & INODE_FLAG_PREALLOC))
+    {
+      inode_shrink(inode_get(inum), 0);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+// Put a file that was unlinked while still open on the orphan list, which is kept on disk so the
+// inode is still freed at the next mount if the image is unmounted (or nufs dies) before the file
+// is closed. Directories have no handles and are never orphaned, so the link shares its field with
+// the directory index.
+void inode_orphan_add(int inum)
+{
+  inode_t *nodep = inode_get(inum);
+  assert(nodep->refs == 0);
+  assert(!inode_is_dir(nodep));
+
+  superblock_t *sbp = block_superblock();
+  nodep->next_orphan_inum = sbp->orphan_inum;
+  sbp->orphan_inum = inum;
+}
+
+// Take an inode off the orphan list, before it is freed.
+void inode_orphan_remove(int inum)
+{
+  int *linkp = &block_superblock()->orphan_inum;
+
+  while (*linkp != inum)
+  {
+    assert(*linkp >= 0);
+    linkp = &inode_get(*linkp)->next_orphan_inum;
+  }
+
+  inode_t *nodep = inode_get(inum);
+  *linkp = nodep->next_orphan_inum;
+  nodep->next_orphan_inum = -1;
+}
+
+// Free every inode left on the orphan list, which at mount are the files that were still open when
+// the image was last unmounted. Returns the number of inodes freed.
+int inode_free_orphans(void)
+{
+  superblock_t *sbp = block_superblock();
+  int count = 0;
+
+  while (sbp->orphan_inum >= 0)
+  {
+    int inum = sbp->orphan_inum;
+    inode_orphan_remove(inum);
+    inode_free(inum);
+    count++;
+  }
+
+  return count;
 }
 
 int inode_get_bnum(inode_t *nodep, int file_bnum)
@@ -292,22 +1759,23 @@ int inode_get_bnum(inode_t *nodep, int file_bnum)
   assert(nodep);
   assert(file_bnum >= 0);
 
-  // If the file block number is less than the block cap just grab it from the local block list.
-  if (file_bnum < INODE_LOCAL_BLOCK_CAP)
+  // Binary search for the last extent starting at or before the file block.
+  int extent_num = inode_extent_find(nodep, file_bnum);
+
+  if (extent_num < 0)
   {
-    // If the block is not present, -1 will be the value and therefore will get returned which
-    // takes care of itself nicely.
-    return nodep->blocks[file_bnum];
+    return -1;
   }
 
-  // Since we didn't find the block in the local list, return -1 if the next child doesn't exist.
-  if (nodep->next < 0)
+  // Return -1 if the block falls in the hole after that extent.
+  extent_t *extp = inode_extent(nodep, extent_num);
+
+  if (file_bnum >= extp->fbnum + extp->count)
   {
     return -1;
   }
 
-  // Recursively look into the child.
-  return inode_get_bnum(inode_get(nodep->next), file_bnum - INODE_LOCAL_BLOCK_CAP);
+  return extp->bnum + (file_bnum - extp->fbnum);
 }
 
 void *inode_end(inode_t *nodep)
@@ -315,16 +1783,22 @@ void *inode_end(inode_t *nodep)
   assert(nodep);
 
   // Calculate a pointer to the first byte directly after the end of the last byte in the file.
-  int total_size = inode_total_size(nodep);
-  int last_block_size = total_size % BLOCK_SIZE;
-  int last_block_num = inode_get_bnum(nodep, total_size / BLOCK_SIZE);
-  return block_get(last_block_num) + last_block_size;
+  off_t total_size = inode_total_size(nodep);
+
+  if (inode_is_inline(nodep))
+  {
+    return nodep->inline_data + total_size;
+  }
+
+  int last_block_size = total_size & BLOCK_MASK;
+  return inode_block_data(nodep, total_size >> BLOCK_SHIFT) + last_block_size;
 }
 
-int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, int offset, int size)
+int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, off_t offset, off_t size)
 {
   assert(nodep);
   assert(iter);
+  assert(offset >= 0);
 
   // Ensure the size is a worthwhile quantity,
   if (size < 1)
@@ -334,19 +1808,31 @@ int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, int offset, i
 
   // Calculate the total size of the inode and how many bytes can actually be iterated over given
   // its size.
-  int total_size = inode_total_size(nodep);
+  off_t total_size = inode_total_size(nodep);
   size = MIN(total_size - offset, size);
 
+  // Nothing can be iterated over at or past the end of the file.
+  if (size < 1)
+  {
+    return 0;
+  }
+
+  // Inline data is a single contiguous run inside the inode.
+  if (inode_is_inline(nodep))
+  {
+    return iter(buf, nodep->inline_data + offset, 0, size);
+  }
+
   // Determine the offset and fill size for the first block. For any future blocks, the offset will
   // always be 0.
-  int remaining_size = size;
-  int file_bnum = offset / BLOCK_SIZE;
-  offset %= BLOCK_SIZE;
-  void *block_start = block_get(inode_get_bnum(nodep, file_bnum));
-  int block_iter_size = MIN(BLOCK_SIZE - offset, remaining_size);
+  off_t remaining_size = size;
+  int file_bnum = offset >> BLOCK_SHIFT;
+  int block_offset = offset & BLOCK_MASK;
+  void *block_start = inode_block_data(nodep, file_bnum);
+  int block_iter_size = MIN(BLOCK_SIZE - block_offset, remaining_size);
 
   // Call the iterator on the first block. If the return value is an error code, return the code.
-  int rv = iter(buf, block_start + offset, 0, block_iter_size);
+  int rv = iter(buf, block_start + block_offset, 0, block_iter_size);
 
   if (rv < 0)
   {
@@ -361,7 +1847,7 @@ int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, int offset, i
   {
     // Find the size to iterate with.
     file_bnum++;
-    block_start = block_get(inode_get_bnum(nodep, file_bnum));
+    block_start = inode_block_data(nodep, file_bnum);
     block_iter_size = MIN(BLOCK_SIZE, remaining_size);
 
     // Call the iterator (we now know the offset must be 0 every time since it is not the first
@@ -384,26 +1870,35 @@ int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, int offset, i
 typedef struct inode_fill_iter_data
 {
   byte_t fill;
-  int size;
 } inode_fill_iter_data_t;
 
-int inode_fill_iter(void *buf, void *start, int offset, int size)
+int inode_fill_iter(void *buf, void *start, off_t offset, int size)
 {
   assert(buf);
 
   inode_fill_iter_data_t *datap = buf;
   memset(start, datap->fill, size);
 
-  return datap->size;
+  return 0;
 }
 
-int inode_fill(inode_t *nodep, int offset, byte_t fill, int size)
+int inode_fill(inode_t *nodep, off_t offset, byte_t fill, off_t size)
 {
   assert(nodep);
 
+  // Holes have to be backed by blocks before they can be written to.
+  size = MIN(size, inode_total_size(nodep) - offset);
+  off_t mapped = inode_map_range(nodep, offset, size);
+
+  if (mapped < 0)
+  {
+    return (int) mapped;
+  }
+
   // Create the data pass structure and iterate with the fill iterator function.
-  inode_fill_iter_data_t data = {fill, size};
-  return inode_block_iter(nodep, &inode_fill_iter, &data, offset, size);
+  inode_fill_iter_data_t data = {fill};
+  int rv = inode_block_iter(nodep, &inode_fill_iter, &data, offset, mapped);
+  return mapped < size ? -ENOSPC : rv;
 }
 
 void inode_print(inode_t *nodep)
@@ -411,66 +1906,54 @@ void inode_print(inode_t *nodep)
   assert(nodep);
 
   printf(
-      "INODE(r=%d, m=%o, s=%d, b={%d, %d, %d, %d}, n=%d)\n",
-      nodep->refs, nodep->mode, nodep->size,
-      nodep->blocks[0], nodep->blocks[1], nodep->blocks[2], nodep->blocks[3],
-      nodep->next);
+      "INODE(r=%d, m=%o, f=%x, s=%lld, b=%lld, g=%u, e=%d, x=%d, t=%d:%d+%d)\n",
+      nodep->refs, nodep->mode, nodep->flags, (long long) nodep->size, (long long) nodep->blocks,
+      nodep->generation, nodep->extent_count, nodep->extent_bnum, nodep->tail_bnum,
+      nodep->tail_frag, nodep->tail_frags);
 }
 
-void inode_print_tree(inode_t *nodep)
+void inode_print_extents(inode_t *nodep)
 {
   assert(nodep);
 
-  int i, j;
-
-  for (i = 0;; i++)
-  {
-    if (i > 0)
-    {
-      repeat_print(" ", 3 * (i - 1));
-      printf(" \u2514\u2500");
-    }
-
-    inode_print(nodep);
+  extent_t *extp;
 
-    if (nodep->next < 0)
-    {
-      return;
-    }
+  printf("\033[0;1mIdx\tFile\tDisk\tCount\033[0m\n");
 
-    nodep = inode_get(nodep->next);
+  for (int extent_num = 0; extent_num < nodep->extent_count; extent_num++)
+  {
+    extp = inode_extent(nodep, extent_num);
+    printf("%d\t%d\t%d\t%d\n", extent_num, extp->fbnum, extp->bnum, extp->count);
   }
 }
 
-void inode_print_blocks_label_offset(inode_t *nodep, int label_offset)
+void inode_print_blocks(inode_t *nodep)
 {
+  assert(nodep);
+
   int bnum;
 
-  for (int i = 0; i < INODE_LOCAL_BLOCK_CAP; i++)
+  for (int file_bnum = 0; file_bnum < inode_mapped_blocks(nodep); file_bnum++)
   {
-    bnum = nodep->blocks[i];
+    bnum = inode_get_bnum(nodep, file_bnum);
 
-    if (bnum >= 0)
+    // Skip holes.
+    if (bnum < 0)
     {
-      printf("\033[0;1;92mBLOCK %d (BNUM %d)\033[0m\n", i + label_offset, bnum);
-      block_print(bnum);
+      continue;
     }
-  }
 
-  if (nodep->next >= 0)
-  {
-    inode_t *nextp = inode_get(nodep->next);
-    inode_print_blocks_label_offset(nextp, label_offset + INODE_LOCAL_BLOCK_CAP);
+    printf("\033[0;1;92mBLOCK %d (BNUM %d)\033[0m\n", file_bnum, bnum);
+    block_print(bnum);
   }
 }
 
-void inode_print_blocks(inode_t *nodep)
-{
-  inode_print_blocks_label_offset(nodep, 0);
-}
-
 void inode_print_bitmap(void)
 {
-  // Display the allocation bitmap.
-  bitmap_print(block_inode_bitmap_start(), MAX_INODE_COUNT);
+  // Display the allocation bitmap of every group.
+  for (int group_num = 0; group_num < block_superblock()->inode_group_count; group_num++)
+  {
+    printf("\033[0;1mGROUP %d (%d free)\033[0m\n", group_num, inode_group(group_num)->free_count);
+    bitmap_print(inode_group(group_num)->bitmap, INODE_GROUP_SIZE);
+  }
 }
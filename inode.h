@@ -3,48 +3,204 @@
 #ifndef _INODE_H
 #define _INODE_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include "util.h"
+#include "specs.h"
+#include "block.h"
 
 #define INODE_FILE 0100000
 #define INODE_DIR  0040000
 
-// inode should be total of 32 bytes
-#define INODE_LOCAL_BLOCK_CAP 4
-#define INODE_MAX_LOCAL_SIZE BLOCK_SIZE * INODE_LOCAL_BLOCK_CAP
+// Every on-disk inode is exactly INODE_SIZE bytes. Each slice of the table starts on a block
+// boundary and the size divides the block size, so no inode ever straddles a block.
+#define INODE_SIZE 256
+#define INODE_LOCAL_EXTENT_CAP 15
 
-// Note that inodes form a tree. If an inode is the child of another inode, its size will likely be
-// innacurate since the size of a subnode is not useful information to the algorithms that manage
-// these nodes.
+// The contents of small regular files are stored in the inode itself, in the space the extents
+// would otherwise use.
+#define INODE_INLINE_CAP 180
+
+// Bits of the inode flags.
+#define INODE_FLAG_INLINE  0x1 // the data (or symbolic link target) lives in inline_data
+#define INODE_FLAG_PREALLOC 0x2 // the blocks past the end were preallocated speculatively
+#define INODE_FLAG_DIRHDR  0x4 // the directory starts with a dirhdr_t in front of its records
+#define INODE_FLAG_DIRSUM  0x8 // the directory header goes on to hold the totals of its tree
+#define INODE_FLAG_INTERNAL 0x10 // the inode holds a directory index, has no file type and no name
+
+// A file being appended to gets unwritten blocks preallocated past its end once it is at least
+// INODE_PREALLOC_MIN bytes, so that it keeps growing into one long run. At most
+// INODE_PREALLOC_FILES files hold such a reservation at a time, each of at most INODE_PREALLOC_MAX
+// bytes.
+#define INODE_PREALLOC_MIN   (64 << 10)
+#define INODE_PREALLOC_MAX   (16 << 20)
+#define INODE_PREALLOC_FILES 64
+
+// Timestamps inode_touch() sets to the current time.
+#define INODE_ATIME 0x1
+#define INODE_MTIME 0x2
+#define INODE_CTIME 0x4
+
+// Reads only update the access time if it isn't newer than the modification or change time, or if
+// it is at least this many seconds old, like the relatime mount option.
+#define INODE_ATIME_INTERVAL (24 * 60 * 60)
+
+// Number of inodes whose last looked up extent is remembered, a power of two.
+#define INODE_MAP_HINTS 256
+
+// Extents that don't fit in the inode spill into leaf blocks full of extents. The leaf block numbers
+// are themselves kept in a single extent index block.
+#define EXTENT_LEAF_CAP  (BLOCK_SIZE / (int) sizeof(extent_t))
+#define EXTENT_INDEX_CAP (BLOCK_SIZE / (int) sizeof(int))
+#define INODE_MAX_EXTENTS (INODE_LOCAL_EXTENT_CAP + EXTENT_INDEX_CAP * EXTENT_LEAF_CAP)
+
+// Inodes are handed out in groups of INODE_GROUP_SIZE. Each group owns a contiguous slice of the
+// inode table that is allocated from the data area when the group is added, so the table grows
+// with the number of files instead of being sized up front.
+#define INODE_GROUP_SIZE   256
+#define INODE_GROUP_WORDS  (INODE_GROUP_SIZE / 64)
+#define INODE_GROUP_BLOCKS ((INODE_GROUP_SIZE * INODE_SIZE + BLOCK_MASK) >> BLOCK_SHIFT)
+
+// An entry of the group descriptor table. Allocating an inode only has to look at the free count of
+// a group and then its bitmap a word at a time.
+typedef struct inode_group
+{
+  int table_bnum;                     // first block of the group's slice of the inode table
+  int free_count;                     // inodes of the group not in use
+  int reserved[2];                    // zero, free for future use
+  uint64_t bitmap[INODE_GROUP_WORDS]; // bit set for every inode of the group in use
+} inode_group_t;
+
+// A run of contiguous disk blocks backing a run of contiguous file blocks. The blocks of an unwritten
+// extent are allocated (by fallocate) but were never written, so they read back as zeroes whatever
+// is on disk.
+typedef struct extent
+{
+  int fbnum;                  // first file block number covered by this extent
+  int bnum;                   // disk block number backing fbnum
+  int count : 31;             // number of blocks in the run
+  unsigned int unwritten : 1; // the blocks hold no data yet
+} extent_t;
+
+// The extents of a file are sorted by fbnum. The first INODE_LOCAL_EXTENT_CAP live in the inode
+// itself and any further extents live in leaf blocks, so looking up a block is a binary search
+// over the extents rather than a walk over every block in the file.
+//
+// Everything stat() needs sits in the first 64 bytes so a getattr touches a single cache line. Files
+// small enough to be inline keep their data in the same inode instead of the extents, so creating,
+// writing and reading one never touches a data block or the block bitmap.
+//
+// File blocks that no extent covers are holes and read back as zeroes. Regular files only get
+// blocks where data is written, so extending one is just a size change. Bytes past the end of the
+// file in its last block are always kept zeroed for the same reason.
+//
+// A regular file whose last block is only partly used can keep that block in a run of fragments
+// instead. The extents then map none of the blocks from size >> BLOCK_SHIFT on and the final
+// size & BLOCK_MASK bytes live in the tail fragments.
+//
+// Nothing outside inode.c should touch these fields directly; use the accessors below.
 typedef struct inode
 {
-  int refs;                          // reference/link count
-  int mode;                          // permission & type
-  int size;                          // bytes
-  int blocks[INODE_LOCAL_BLOCK_CAP]; // <0 if unused, otherwise points to a block
-  int next;                          // -1 if no other inode, otherwise inum of next inode
+  int mode;                                 // permission & type
+  int refs;                                 // reference/link count
+  int flags;                                // INODE_FLAG_* bits
+  unsigned int generation;                  // bumped every time the inode number is reused
+  int64_t size;                             // bytes
+  int64_t blocks;                           // blocks allocated to the file, including extent blocks
+  int64_t atime;                            // last access, nanoseconds since the epoch
+  int64_t mtime;                            // last content modification
+  int64_t ctime;                            // last inode change
+  int tail_bnum;                            // -1 if unused, otherwise the block holding the tail
+  unsigned short tail_frag;                 // first fragment of the tail within tail_bnum
+  unsigned short tail_frags;                // number of fragments in the tail
+  int extent_count;                         // number of extents in use
+  int extent_bnum;                          // -1 if unused, otherwise the extent index block
+  union
+  {
+    int index_inum;                         // -1 if unused, otherwise inum of the directory index
+    int next_orphan_inum;                   // -1 if last, otherwise next inode on the orphan list
+    int parent_inum;                        // -1 if none, otherwise directory the file counts in
+  };
+  union
+  {
+    extent_t extents[INODE_LOCAL_EXTENT_CAP]; // the first extents of the file
+    byte_t inline_data[INODE_INLINE_CAP];     // the whole file if INODE_FLAG_INLINE is set
+  };
 } inode_t;
 
-// Define a block iterator for reading, writing, filling, etc.
-typedef int (* block_iter_t)(void *buf, void *start, int offset, int size);
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must be exactly INODE_SIZE bytes");
+_Static_assert(MIN_BLOCK_SIZE % INODE_SIZE == 0, "inodes must never straddle a block");
+
+// An in-memory hint pointing at the extent an inode last looked up.
+typedef struct inode_map_hint
+{
+  const inode_t *nodep; // inode the hint is for, NULL if unused
+  int extent_num;       // index of the extent
+} inode_map_hint_t;
+
+// Define a block iterator for reading, writing, filling, etc. Holes are passed in as a shared block
+// of zeroes, so a range has to be mapped with inode_map_range() before it is written to.
+typedef int (* block_iter_t)(void *buf, void *start, off_t offset, int size);
 
+size_t inode_gdt_size(int group_max);
+int inode_format(int group_count, int group_max);
+void inode_init(void);
+inode_group_t *inode_group(int group_num);
+int inode_group_add(void);
 bool_t inode_exists(int inum);
 inode_t *inode_get(int inum);
 void inode_reset(inode_t *nodep);
-int inode_total_size(inode_t *nodep);
-inode_t *inode_last_child(inode_t *nodep);
-inode_t *inode_second_to_last_child(inode_t *nodep);
+int inode_get_mode(inode_t *nodep);
+void inode_set_mode(inode_t *nodep, int mode);
+bool_t inode_is_dir(inode_t *nodep);
+bool_t inode_is_inline(inode_t *nodep);
+const void *inode_inline_data(inode_t *nodep);
+int inode_get_refs(inode_t *nodep);
+int inode_add_refs(inode_t *nodep, int delta);
+int inode_get_flags(inode_t *nodep);
+void inode_set_flags(inode_t *nodep, int flags);
+unsigned int inode_get_generation(inode_t *nodep);
+off_t inode_total_size(inode_t *nodep);
+int64_t inode_get_sectors(inode_t *nodep);
+struct timespec inode_get_atime(inode_t *nodep);
+struct timespec inode_get_mtime(inode_t *nodep);
+struct timespec inode_get_ctime(inode_t *nodep);
+void inode_set_atime(inode_t *nodep, struct timespec ts);
+void inode_set_mtime(inode_t *nodep, struct timespec ts);
+void inode_set_ctime(inode_t *nodep, struct timespec ts);
+void inode_touch(inode_t *nodep, int times);
+void inode_touch_atime(inode_t *nodep);
+int inode_get_index(inode_t *nodep);
+void inode_set_index(inode_t *nodep, int index_inum);
+int inode_get_parent(inode_t *nodep);
+void inode_set_parent(inode_t *nodep, int parent_inum);
 int inode_alloc(void);
+int inode_alloc_near(int goal_inum);
 int inode_free(int inum);
 int inode_clear(inode_t *nodep);
-int inode_grow(inode_t *nodep, int size);
-int inode_grow_zero(inode_t *nodep, int size);
-int inode_shrink(inode_t *nodep, int size);
+int inode_grow(inode_t *nodep, off_t size);
+int inode_grow_sparse(inode_t *nodep, off_t size);
+off_t inode_map_range(inode_t *nodep, off_t offset, off_t size);
+int inode_shrink(inode_t *nodep, off_t size);
+int inode_punch(inode_t *nodep, off_t offset, off_t size);
+int inode_fallocate(inode_t *nodep, off_t offset, off_t size, bool_t keep_size);
+int inode_zero_range(inode_t *nodep, off_t offset, off_t size, bool_t keep_size);
+void inode_speculate(inode_t *nodep, off_t offset);
+void inode_forget_prealloc(inode_t *nodep);
+int inode_trim_prealloc(inode_t *nodep);
+bool_t inode_trim_all_prealloc(void);
+int inode_trim_stale_prealloc(void);
+void inode_orphan_add(int inum);
+void inode_orphan_remove(int inum);
+int inode_free_orphans(void);
+int inode_pack_tail(inode_t *nodep);
 int inode_get_bnum(inode_t *nodep, int file_bnum);
 void *inode_end(inode_t *nodep);
-int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, int offset, int size);
-int inode_fill(inode_t *nodep, int offset, byte_t fill, int size);
+int inode_block_iter(inode_t *nodep, block_iter_t iter, void *buf, off_t offset, off_t size);
+int inode_fill(inode_t *nodep, off_t offset, byte_t fill, off_t size);
 void inode_print(inode_t *nodep);
-void inode_print_tree(inode_t *nodep);
+void inode_print_extents(inode_t *nodep);
 void inode_print_blocks(inode_t *nodep);
 void inode_print_bitmap(void);
 
@@ -0,0 +1,97 @@
+///
+/// mkfs.nufs: formats a disk image of arbitrary size for use with nufs.
+///
+/// Usage: mkfs.nufs [-s size] [-b block_size] [-i inodes] image
+///
+/// The size accepts an optional K, M, G or T suffix and is rounded down to a whole number of
+/// blocks. The block size must be a power of two between 1K and 64K and defaults to 4K. The inode
+/// table starts out with a single group and grows as files are created, up to the given inode count.
+/// If no inode count is given, the limit is one inode per DEFAULT_INODE_RATIO bytes.
+///
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "specs.h"
+#include "block.h"
+#include "storage.h"
+
+void mkfs_usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-s size[K|M|G|T]] [-b block_size[K]] [-i inodes] image\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+  long long size = (long long) DEFAULT_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  long long block_size = DEFAULT_BLOCK_SIZE;
+  long long inode_count = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:b:i:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      size = parse_size(optarg);
+      break;
+    case 'b':
+      block_size = parse_size(optarg);
+      break;
+    case 'i':
+      inode_count = parse_size(optarg);
+      break;
+    default:
+      mkfs_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Exactly one image path must follow the options.
+  if (optind != argc - 1 || size < 0 || block_size < 1 || inode_count < 0)
+  {
+    mkfs_usage(argv[0]);
+    return 1;
+  }
+
+  // Block numbers are stored as ints so the block count must fit in one.
+  long long block_count = size / block_size;
+
+  if (block_count > 0x7fffffff || block_size > 0x7fffffff || inode_count > 0x7fffffff)
+  {
+    fprintf(stderr, "%s: image too large\n", argv[0]);
+    return 1;
+  }
+
+  const char *image_path = argv[optind];
+  int rv = storage_format(image_path, (int) block_count, (int) block_size, (int) inode_count);
+
+  if (rv < 0)
+  {
+    fprintf(stderr, "%s: cannot format %s: %s\n", argv[0], image_path, strerror(-rv));
+    return 1;
+  }
+
+  // Report the resulting geometry.
+  block_init(image_path);
+  superblock_t *sbp = block_superblock();
+
+  printf("%s: %d blocks of %d bytes, inodes of %d bytes\n", image_path, sbp->block_count,
+         sbp->block_size, sbp->inode_size);
+  printf("  inode groups: %d of %d inodes, growing to at most %d groups\n",
+         sbp->inode_group_count, sbp->inode_group_size, sbp->inode_group_max);
+  printf("  block bitmap: blocks %d-%d\n", sbp->block_bitmap_bnum,
+         sbp->block_bitmap_bnum + sbp->block_bitmap_blocks - 1);
+  printf("  fragment map: blocks %d-%d\n", sbp->fragmap_bnum,
+         sbp->fragmap_bnum + sbp->fragmap_blocks - 1);
+  printf("  group table:  blocks %d-%d\n", sbp->gdt_bnum, sbp->gdt_bnum + sbp->gdt_blocks - 1);
+  printf("  data:         blocks %d-%d\n", sbp->content_bnum, sbp->block_count - 1);
+
+  block_deinit();
+  return 0;
+}
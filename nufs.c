@@ -2,6 +2,8 @@
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -11,7 +13,7 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
-#include "slist.h"
+#include "control.h"
 #include "storage.h"
 
 // implementation for: man 2 access
@@ -47,6 +49,20 @@ int nufs_getattr(const char *path, struct stat *stp)
   return storage_stat(path, stp);
 }
 
+int nufs_fgetattr(const char *path, struct stat *stp, struct fuse_file_info *fi)
+{
+  printf("fgetattr(%s)\n", path);
+
+  // Ensure the stat pointer is not null.
+  if (!stp)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage, through the handle if the file is open.
+  return fi ? storage_fstat(fi->fh, stp) : nufs_getattr(path, stp);
+}
+
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
 // Note, for this assignment, you can alternatively implement the create
@@ -79,6 +95,34 @@ int nufs_link(const char *from, const char *to)
   return storage_link(from, to);
 }
 
+int nufs_symlink(const char *target, const char *path)
+{
+  printf("symlink(%s => %s)\n", path, target);
+
+  // Ensure the target and link paths are not null.
+  if (!target || !path)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage.
+  return storage_symlink(target, path);
+}
+
+int nufs_readlink(const char *path, char *buf, size_t size)
+{
+  printf("readlink(%s, %ld bytes)\n", path, size);
+
+  // Ensure the path and buffer are not null.
+  if (!path || !buf)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage.
+  return storage_readlink(path, buf, size);
+}
+
 int nufs_unlink(const char *path)
 {
   printf("unlink(%s)\n", path);
@@ -123,20 +167,28 @@ int nufs_truncate(const char *path, off_t size)
   return storage_truncate(path, size);
 }
 
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  printf("ftruncate(%s, %ld bytes)\n", path, size);
+
+  // Delegate to storage, through the handle if the file is open.
+  return fi ? storage_ftruncate(fi->fh, size) : nufs_truncate(path, size);
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
   printf("read(%s, %ld bytes, @+%ld)\n", path, size, offset);
 
-  // Ensure the path and buffer are not null.
-  if (!path || !buf)
+  // Ensure the buffer is not null, and the path if the file isn't open.
+  if (!buf || (!fi && !path))
   {
     return -EINVAL;
   }
 
-  // Delegate to storage.
-  return storage_read(path, buf, size, offset);
+  // Delegate to storage, through the handle if the file is open.
+  return fi ? storage_read_fh(fi->fh, buf, size, offset) : storage_read(path, buf, size, offset);
 }
 
 // Actually write data
@@ -145,14 +197,14 @@ int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
 {
   printf("write(%s, %ld bytes, @+%ld)\n", path, size, offset);
 
-  // Ensure the path and buffer are not null.
-  if (!path || !buf)
+  // Ensure the buffer is not null, and the path if the file isn't open.
+  if (!buf || (!fi && !path))
   {
     return -EINVAL;
   }
 
-  // Delegate to storage.
-  return storage_write(path, buf, size, offset);
+  // Delegate to storage, through the handle if the file is open.
+  return fi ? storage_write_fh(fi->fh, buf, size, offset) : storage_write(path, buf, size, offset);
 }
 
 // most of the following callbacks implement
@@ -192,58 +244,70 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
   printf("readdir(%s)\n", path);
   
-  // Ensure the path and filler function pointer are not null.
-  if (!path || !filler)
+  // Ensure the filler function pointer is not null.
+  if (!filler)
   {
     return -EINVAL;
   }
 
-  slist_t *names = NULL;
-  struct stat st;
-  int rv;
-
-  rv = storage_list(path, &names);
-
-  // If an issue occured, return this error code.
-  if (rv < 0)
+  // Delegate to storage, which fills in the entries from the given offset on with their stats until
+  // the buffer is full. The kernel asks again with the offset of the first entry that didn't fit.
+  if (fi)
   {
-    return rv;
+    return storage_readdir_fh(fi->fh, buf, filler, offset);
   }
 
-  // If the directory is empty, return immediately.
-  if (!names)
+  // Ensure the path is not null.
+  if (!path)
   {
-    slist_free(names);
-    return 0;
+    return -EINVAL;
   }
 
-  slist_t *name_item = names;
-  
-  while (name_item)
+  return storage_readdir(path, buf, filler, offset);
+}
+
+// implementation for: man 3 opendir
+int nufs_opendir(const char *path, struct fuse_file_info *fi)
+{
+  printf("opendir(%s)\n", path);
+
+  // Ensure the path and file info are not null.
+  if (!path || !fi)
   {
-    rv = storage_stat(path, &st);
+    return -EINVAL;
+  }
 
-    if (rv < 0)
-    {
-      slist_free(names);
-      return rv;
-    }
+  // Delegate to storage, which resolves the directory and hands back a handle for readdir.
+  return storage_opendir(path, &fi->fh);
+}
 
-    filler(buf, name_item->data, &st, 0);
+// Called once the last handle to an open directory is closed.
+int nufs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  printf("releasedir(%s)\n", path);
 
-    name_item = name_item->next;
+  // Ensure the file info is not null.
+  if (!fi)
+  {
+    return -EINVAL;
   }
 
-  slist_free(names);
-  return 0;
+  // Delegate to storage, which frees the handle.
+  return storage_releasedir(fi->fh);
 }
 
 int nufs_chmod(const char *path, mode_t mode)
 {
   printf("chmod(%s, %04o)\n", path, mode);
-  
-  // We are not implementing this, so imply return 0.
-  return 0;
+
+  // Ensure the path is not null.
+  if (!path)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage.
+  return storage_chmod(path, mode);
 }
 
 // This is called on open, but doesn't need to do much
@@ -254,35 +318,175 @@ int nufs_open(const char *path, struct fuse_file_info *fi)
 {
   printf("open(%s)\n", path);
 
-  int rv = nufs_access(path, F_OK | R_OK | W_OK);
-
-  if (rv < 0)
+  // Ensure the path and file info are not null.
+  if (!path || !fi)
   {
-    return rv;
+    return -EINVAL;
   }
-  
-  // We are not implementing this, so imply return 0.
+
+  // Resolve the path once and keep the handle for every later request on the file.
+  return storage_open(path, &fi->fh);
+}
+
+int nufs_statfs(const char *path, struct statvfs *stp)
+{
+  printf("statfs(%s)\n", path);
+
+  // Delegate to storage. Every path is in the same image.
+  storage_statfs(stp);
   return 0;
 }
 
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  printf("fsync(%s, %d)\n", path, datasync);
+
+  // Ensure the file info is not null.
+  if (!fi)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage.
+  return storage_fsync(fi->fh);
+}
+
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t size, struct fuse_file_info *fi)
+{
+  printf("fallocate(%s, %x, %ld bytes, @+%ld)\n", path, mode, size, offset);
+
+  // Ensure the file info is not null.
+  if (!fi)
+  {
+    return -EINVAL;
+  }
+
+  int keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+
+  // Delegate to storage. Punching a hole never changes the size of the file, so the kernel always
+  // asks to keep it.
+  switch (mode & ~FALLOC_FL_KEEP_SIZE)
+  {
+  case 0:
+    return storage_fallocate(fi->fh, offset, size, keep_size);
+  case FALLOC_FL_PUNCH_HOLE:
+    return keep_size ? storage_punch_hole(fi->fh, offset, size) : -EOPNOTSUPP;
+  case FALLOC_FL_ZERO_RANGE:
+    return storage_zero_range(fi->fh, offset, size, keep_size);
+  default:
+    return -EOPNOTSUPP;
+  }
+}
+
+// Called once the last handle to an open file is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi)
+{
+  printf("release(%s)\n", path);
+
+  // Ensure the file info is not null.
+  if (!fi)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage, which frees the handle.
+  return storage_release(fi->fh);
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2])
 {
   printf("utimens(%s, [%ld, %ld; %ld %ld])\n", path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec,
          ts[1].tv_nsec);
 
-  // We are not implementing this, so imply return 0.
-  return 0;
+  // Ensure the path is not null.
+  if (!path)
+  {
+    return -EINVAL;
+  }
+
+  // Delegate to storage, which also understands UTIME_NOW and UTIME_OMIT.
+  return storage_utimens(path, ts);
 }
 
-// Extended operations
+// Check that an ioctl came with an argument of the size the command calls for. FUSE sizes the
+// buffer from the command, so a command only matches with the size encoded in it, but the buffer
+// is still checked before it is used.
+int nufs_ioctl_arg(int cmd, void *data, size_t size)
+{
+  return data && _IOC_SIZE((unsigned int) cmd) == size ? 0 : -EINVAL;
+}
+
+// Extended operations, see control.h. FS_IOC_GETVERSION reports the generation of the inode, like
+// lsattr -v does on ext4.
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data)
 {
   printf("ioctl(%s, %d, ...)\n", path, cmd);
-  
-  // We are not implementing this, so imply return 0.
-  return 0;
+
+  int rv;
+
+  switch ((unsigned int) cmd)
+  {
+  case NUFS_IOC_GROW:
+    if ((rv = nufs_ioctl_arg(cmd, data, sizeof(uint64_t))) < 0)
+    {
+      return rv;
+    }
+
+    return storage_grow((off_t) *(uint64_t *) data);
+  case NUFS_IOC_STATS:
+    if ((rv = nufs_ioctl_arg(cmd, data, sizeof(nufs_stats_t))) < 0)
+    {
+      return rv;
+    }
+
+    storage_get_stats(data);
+    return 0;
+  case FS_IOC_GETVERSION:
+  {
+    if ((rv = nufs_ioctl_arg(cmd, data, sizeof(long))) < 0)
+    {
+      return rv;
+    }
+
+    unsigned int generation;
+    rv = fi ? storage_get_generation(fi->fh, &generation) : -EBADF;
+
+    if (rv < 0)
+    {
+      return rv;
+    }
+
+    // The argument is declared as a long, though ext4 and lsattr only use an int of it.
+    *(long *) data = generation;
+    return 0;
+  }
+  case NUFS_IOC_USAGE:
+    if ((rv = nufs_ioctl_arg(cmd, data, sizeof(nufs_usage_t))) < 0)
+    {
+      return rv;
+    }
+
+    return path ? storage_get_usage(path, data) : -ENOENT;
+  case NUFS_IOC_COMPACT:
+    if ((rv = nufs_ioctl_arg(cmd, data, sizeof(uint64_t))) < 0)
+    {
+      return rv;
+    }
+
+    rv = path ? storage_compact(path) : -ENOENT;
+
+    if (rv < 0)
+    {
+      return rv;
+    }
+
+    *(uint64_t *) data = rv;
+    return 0;
+  default:
+    return -ENOTTY;
+  }
 }
 
 void nufs_init_ops(struct fuse_operations *ops)
@@ -293,38 +497,58 @@ void nufs_init_ops(struct fuse_operations *ops)
   // Implemented working versions.
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->fgetattr = nufs_fgetattr;
   ops->mknod = nufs_mknod;
   ops->link = nufs_link;
+  ops->symlink = nufs_symlink;
+  ops->readlink = nufs_readlink;
   ops->unlink = nufs_unlink;
   ops->rename = nufs_rename;
   ops->truncate = nufs_truncate;
+  ops->ftruncate = nufs_ftruncate;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->mkdir = nufs_mkdir;
   ops->rmdir = nufs_rmdir;
   ops->readdir = nufs_readdir;
+  ops->opendir = nufs_opendir;
+  ops->releasedir = nufs_releasedir;
+  ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->statfs = nufs_statfs;
+  ops->fallocate = nufs_fallocate;
+  ops->ioctl = nufs_ioctl;
 
   // ops->create   = nufs_create; // alternative to mknod
 
+  // Requests on an open file go through its handle, so they don't need a path. That lets an
+  // unlinked file be used until it is closed.
+  ops->flag_nullpath_ok = 1;
+
   // Implemented dummy versions.
   ops->chmod = nufs_chmod;
-  ops->open = nufs_open;
   ops->utimens = nufs_utimens;
-  ops->ioctl = nufs_ioctl;
 };
 
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[])
 {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   
   // Initialize the storage putting the disk image file at the given path.
   storage_init(argv[--argc]);
 
   // Initialize the fuse operation function pointer buffer and begin fuse.
   nufs_init_ops(&nufs_ops);
-  int fuse_exit_code = fuse_main(argc, argv, &nufs_ops, NULL);
+
+  // Unlinking an open file removes it right away instead of hiding it under a .fuse_hidden name,
+  // since storage keeps the inode alive until its last handle is released.
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  fuse_opt_add_arg(&args, "-ohard_remove");
+  int fuse_exit_code = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
 
   // Deinitialize the storage.
   storage_deinit();
@@ -0,0 +1,120 @@
+///
+/// nufsctl: sends control commands to a mounted nufs instance.
+///
+/// Usage: nufsctl grow size path
+///        nufsctl stats path
+///        nufsctl compact path
+///        nufsctl usage path
+///
+/// The path can be any file or directory inside the mount point, usually the mount point itself.
+/// grow extends the image to the given size (with an optional K, M, G or T suffix) while it stays
+/// mounted, and the new space can be used right away. stats prints the cache counters of the
+/// instance. compact packs the entries of the directory at the given path together and prints how
+/// many blocks that freed. usage prints the bytes, files and directories below the directory at the
+/// given path, which the instance keeps count of, so it is instant however large the tree is.
+///
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "control.h"
+
+void nufsctl_usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s grow size[K|M|G|T] path\n", prog);
+  fprintf(stderr, "       %s stats path\n", prog);
+  fprintf(stderr, "       %s compact path\n", prog);
+  fprintf(stderr, "       %s usage path\n", prog);
+}
+
+// Issue the given ioctl on the given path, printing an error if it fails.
+int nufsctl_ioctl(const char *prog, const char *path, unsigned long request, void *arg)
+{
+  // Any open file or directory in the mount reaches the same instance.
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: cannot open %s: %s\n", prog, path, strerror(errno));
+    return -1;
+  }
+
+  int rv = ioctl(fd, request, arg);
+
+  if (rv < 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+  }
+
+  close(fd);
+  return rv;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 4 && strcmp(argv[1], "grow") == 0)
+  {
+    long long size = parse_size(argv[2]);
+
+    if (size < 0)
+    {
+      nufsctl_usage(argv[0]);
+      return 1;
+    }
+
+    uint64_t arg = size;
+    return nufsctl_ioctl(argv[0], argv[3], NUFS_IOC_GROW, &arg) < 0;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "stats") == 0)
+  {
+    nufs_stats_t stats;
+
+    if (nufsctl_ioctl(argv[0], argv[2], NUFS_IOC_STATS, &stats) < 0)
+    {
+      return 1;
+    }
+
+    printf("dcache hits          %" PRIu64 "\n", stats.dcache_hits);
+    printf("dcache negative hits %" PRIu64 "\n", stats.dcache_negative_hits);
+    printf("dcache misses        %" PRIu64 "\n", stats.dcache_misses);
+    return 0;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "compact") == 0)
+  {
+    uint64_t freed;
+
+    if (nufsctl_ioctl(argv[0], argv[2], NUFS_IOC_COMPACT, &freed) < 0)
+    {
+      return 1;
+    }
+
+    printf("%" PRIu64 " blocks freed\n", freed);
+    return 0;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "usage") == 0)
+  {
+    nufs_usage_t usage;
+
+    if (nufsctl_ioctl(argv[0], argv[2], NUFS_IOC_USAGE, &usage) < 0)
+    {
+      return 1;
+    }
+
+    printf("bytes       %" PRIu64 "\n", usage.bytes);
+    printf("files       %" PRIu64 "\n", usage.files);
+    printf("directories %" PRIu64 "\n", usage.dirs);
+    return 0;
+  }
+
+  nufsctl_usage(argv[0]);
+  return 1;
+}
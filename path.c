@@ -1,6 +1,8 @@
 ///
 /// Utilities for managing paths
 ///
+/// Paths are walked in place, one component at a time, so resolving one never allocates anything.
+///
 
 #include <errno.h>
 #include <string.h>
@@ -10,131 +12,144 @@
 #include "inode.h"
 #include "directory.h"
 
-slist_t *path_explode(const char *path)
-{
-  assert(path);
-
-  // Simply splot the path by slashes.
-  return slist_explode(path, PATH_DELIM);
-}
-
-int inum_for_path_comps_in(int search_root_inum, slist_t *comps)
+bool_t path_next_comp(const char **posp, const char *end, path_comp_t *compp)
 {
-  assert(search_root_inum >= 0);
-  assert(inode_exists(search_root_inum));
-
-  // Get the node.
-  inode_t *dnodep = inode_get(search_root_inum);
+  assert(posp && *posp);
+  assert(end);
+  assert(compp);
 
-  assert(dnodep->mode & INODE_DIR);
+  // Skip the slashes in front of the component. Repeated slashes are the same as one.
+  const char *pos = *posp;
 
-  // If the components are null return no such file error.
-  if (!comps)
+  while (pos < end && *pos == PATH_DELIM)
   {
-    return -ENOENT;
+    pos++;
   }
 
-  // Ensure the data is not null.
-  assert(comps->data);
+  *posp = pos;
 
-  // If the string is empty and the next token exists, i.e. double slash, ignore it and move on to
-  // the next token. But, if the string is empty and there is no next token, return the parent dir.
-  if (!strcmp(comps->data, ""))
+  if (pos == end)
   {
-    if (comps->next)
-    {
-      return inum_for_path_comps_in(search_root_inum, comps->next);
-    }
-
-    return search_root_inum;
+    return FALSE;
   }
 
-  int entry_inum;
+  // The component runs up to the next slash or the end.
+  const char *comp_end = memchr(pos, PATH_DELIM, end - pos);
 
-  // Lookup the inode in the directory. If it is an error, we can conveniently return this error
-  // code. If the lookup succeeded and this is the end of the path, return the entry.
-  if ((entry_inum = directory_lookup_inum(dnodep, comps->data)) < 0 || !comps->next)
+  if (!comp_end)
   {
-    return entry_inum;
+    comp_end = end;
   }
 
-  // We ensure the entry node is a directory since there is more path coming.
-  if (!(inode_get(entry_inum)->mode & INODE_DIR))
+  compp->name = pos;
+  compp->len = comp_end - pos;
+  *posp = comp_end;
+  return TRUE;
+}
+
+// Copy a component into the given buffer of MAX_DIR_ENTRY_NAME_LEN bytes as a null terminated name.
+int path_comp_name(const path_comp_t *compp, char *name)
+{
+  if (compp->len >= MAX_DIR_ENTRY_NAME_LEN)
   {
-    return -ENOTDIR;
+    return -ENAMETOOLONG;
   }
 
-  // Continue on down the path looking in that directory.
-  return inum_for_path_comps_in(entry_inum, comps->next);
+  memcpy(name, compp->name, compp->len);
+  name[compp->len] = '\0';
+  return 0;
 }
 
-int inum_for_path_in(int search_root_inum, const char *path)
+int inum_for_path_range_in(int search_root_inum, const char *path, const char *end)
 {
   assert(search_root_inum >= 0);
   assert(inode_exists(search_root_inum));
-  assert(inode_get(search_root_inum)->mode & INODE_DIR);
+  assert(inode_is_dir(inode_get(search_root_inum)));
   assert(path);
+  assert(end >= path);
 
-  // Split the path string into components and delegate to the list version of this function.
-  slist_t *comps = path_explode(path);
-  int inum = inum_for_path_comps_in(search_root_inum, comps);
-  slist_free(comps);
+  int inum = search_root_inum;
+  const char *pos = path;
+  path_comp_t comp;
+  char name[MAX_DIR_ENTRY_NAME_LEN];
 
-  // Return the inum or error code.
-  return inum;
-}
+  while (path_next_comp(&pos, end, &comp))
+  {
+    inode_t *dnodep = inode_get(inum);
 
-int path_comps_pop(slist_t *comps, const char **last_comp_namep)
-{
-  assert(last_comp_namep);
-  
-  int i = -1;
-  int last_comp_i = -1;
-  *last_comp_namep = NULL;
+    // There is more path coming, so the node so far must be a directory.
+    if (!inode_is_dir(dnodep))
+    {
+      return -ENOTDIR;
+    }
 
-  while (comps)
-  {
-    i++;
+    int rv = path_comp_name(&comp, name);
 
-    // If this component is not an empty string, set the last component string pointer to this.
-    if (strcmp(comps->data, ""))
+    if (rv < 0)
     {
-      *last_comp_namep = comps->data;
-      last_comp_i = i;
+      return rv;
     }
 
-    comps = comps->next;
+    // Lookup the inode in the directory. If it is an error, we can conveniently return this error
+    // code.
+    if ((inum = directory_lookup_inum(dnodep, name)) < 0)
+    {
+      return inum;
+    }
+  }
+
+  // A trailing slash only makes sense after a directory.
+  if (end > path && end[-1] == PATH_DELIM && !inode_is_dir(inode_get(inum)))
+  {
+    return -ENOTDIR;
   }
 
-  return last_comp_i;
+  return inum;
 }
 
-int path_parent_child_in(int search_root_inum, const char *path, const char **child_namep)
+int inum_for_path_in(int search_root_inum, const char *path)
+{
+  assert(path);
+
+  return inum_for_path_range_in(search_root_inum, path, path + strlen(path));
+}
+
+int path_parent_child_in(int search_root_inum, const char *path, char *child_name)
 {
   assert(search_root_inum >= 0);
   assert(inode_exists(search_root_inum));
   assert(path);
-  assert(child_namep);
+  assert(child_name);
 
-  // Store the name string of the child, but note that it is a pointer to the component data that
-  // will later be freed. This must be duplicated.
-  const char *child_name_tethered;
+  // Find the last component by working back from the end, past any trailing slashes.
+  const char *end = path + strlen(path);
 
-  // Split the path into its components, then get the child name and the index of that child name.
-  slist_t *path_comps = path_explode(path);
-  int name_comp_i = path_comps_pop(path_comps, &child_name_tethered);
+  while (end > path && end[-1] == PATH_DELIM)
+  {
+    end--;
+  }
 
-  // Copy the path to the parent directory into a new component list and get the inum.
-  slist_t *parent_path_comps = slist_copy(path_comps, name_comp_i);
-  int parent_inum = inum_for_path_comps_in(search_root_inum, parent_path_comps);
+  const char *start = end;
 
-  // Make a copy of the tethered name.
-  *child_namep = strdup(child_name_tethered);
+  while (start > path && start[-1] != PATH_DELIM)
+  {
+    start--;
+  }
 
-  // Free the path components.
-  slist_free(path_comps);
-  slist_free(parent_path_comps);
+  // A path with no components has no child.
+  if (start == end)
+  {
+    return -EINVAL;
+  }
+
+  path_comp_t child = {start, end - start};
+  int rv = path_comp_name(&child, child_name);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
 
-  // Return the parent directory's inum.
-  return parent_inum;
+  // The parent is everything in front of the child.
+  return inum_for_path_range_in(search_root_inum, path, start);
 }
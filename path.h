@@ -5,21 +5,29 @@
 #ifndef _PATH_H
 #define _PATH_H
 
-#include "slist.h"
+#include <stddef.h>
+#include "util.h"
 
 #define PATH_DELIM '/'
 
-slist_t *path_explode(const char *path);
-int inum_for_path_comps_in(int search_root_inum, slist_t *comps);
-int inum_for_path_in(int search_root_inum, const char *path);
+// A component of a path. It points into the path string itself instead of being a copy, so it is
+// not null terminated.
+typedef struct path_comp
+{
+  const char *name; // first character of the component
+  size_t len;       // length of the component
+} path_comp_t;
+
+// Steps to the next non-empty component of the path before the given end, skipping the slashes in
+// front of it, and leaves the position just past it. Returns FALSE if no components are left.
+bool_t path_next_comp(const char **posp, const char *end, path_comp_t *compp);
 
-// Pops off the last non-blank component of the path. Returns the index of that last component
-// within the list. Note that the string pointer will be set to a portion of the string allocated in
-// the list. When the list data is freed, so is this string.
-int path_comps_pop(slist_t *comps, const char **last_comp_name);
+// Returns the inum of the node the part of the path before the given end points to.
+int inum_for_path_range_in(int search_root_inum, const char *path, const char *end);
+int inum_for_path_in(int search_root_inum, const char *path);
 
-// Returns the inum of the parent and the name string of the child (the last non-blank item in the
-// path). Note that the child name is on the heap and must later be freed.
-int path_parent_child_in(int search_root_inum, const char *path, const char **child_namep);
+// Returns the inum of the parent and copies the name of the child (the last non-empty component of
+// the path) into the given buffer, which must hold MAX_DIR_ENTRY_NAME_LEN bytes.
+int path_parent_child_in(int search_root_inum, const char *path, char *child_name);
 
 #endif
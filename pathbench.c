@@ -0,0 +1,149 @@
+///
+/// pathbench: measures path resolution in process, without FUSE or the kernel in between.
+///
+/// Usage: pathbench [-d depth] [-n lookups] image
+///
+/// Formats the image, builds a tree of directories depth levels deep with 100 files at the bottom,
+/// and then resolves paths to those files the given number of times, both whole and split into
+/// parent and child like creating or removing a file does. For each it prints the lookups per
+/// second and the heap allocations per lookup. Allocations are counted by wrapping malloc, which
+/// glibc routes its own allocations (strdup and the like) through as well. The storage layer logs
+/// every inode it allocates on stdout, so the results go to stderr.
+///
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "directory.h"
+#include "storage.h"
+
+#define PATHBENCH_FILES 100
+
+extern void *__libc_malloc(size_t size);
+
+static unsigned long malloc_count = 0;
+
+void *malloc(size_t size)
+{
+  malloc_count++;
+  return __libc_malloc(size);
+}
+
+void pathbench_usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-d depth] [-n lookups] image\n", prog);
+}
+
+double pathbench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Print the rate and allocations of a run that started at the given time and malloc count.
+void pathbench_report(const char *name, long depth, long lookups, double start,
+                      unsigned long start_count)
+{
+  double elapsed = pathbench_now() - start;
+
+  fprintf(stderr, "%-14s %8ld %12.0f %14.2f\n", name, depth, lookups / elapsed,
+          (double) (malloc_count - start_count) / lookups);
+}
+
+int main(int argc, char *argv[])
+{
+  long depth = 16;
+  long lookups = 1000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'd':
+      depth = atol(optarg);
+      break;
+    case 'n':
+      lookups = atol(optarg);
+      break;
+    default:
+      pathbench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || depth < 0 || lookups < 1)
+  {
+    pathbench_usage(argv[0]);
+    return 1;
+  }
+
+  // Build the tree in a fresh 64MB image.
+  const char *image_path = argv[optind];
+  unlink(image_path);
+
+  if (storage_format(image_path, 16384, 4096, 0) < 0)
+  {
+    fprintf(stderr, "%s: cannot format %s\n", argv[0], image_path);
+    return 1;
+  }
+
+  storage_init(image_path);
+
+  char dir[PATH_MAX / 2] = "";
+  char path[PATH_MAX];
+
+  for (long level = 1; level <= depth; level++)
+  {
+    snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/level%ld", level);
+    int rv = storage_mknod(dir, STORAGE_DIR | 0755);
+    assert(rv == 0);
+  }
+
+  for (int i = 0; i < PATHBENCH_FILES; i++)
+  {
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    int rv = storage_mknod(path, STORAGE_FILE | 0644);
+    assert(rv == 0);
+  }
+
+  fprintf(stderr, "%-14s %8s %12s %14s\n", "lookup", "depth", "lookups/s", "mallocs/lookup");
+
+  // Resolve whole paths, like stat does.
+  double start = pathbench_now();
+  unsigned long start_count = malloc_count;
+
+  for (long i = 0; i < lookups; i++)
+  {
+    snprintf(path, sizeof(path), "%s/f%ld", dir, i % PATHBENCH_FILES);
+    int inum = storage_inum_for_path(path);
+    assert(inum >= 0);
+  }
+
+  pathbench_report("whole path", depth, lookups, start, start_count);
+
+  // Split paths into the parent directory and the child name, like mknod and unlink do.
+  char name[MAX_DIR_ENTRY_NAME_LEN];
+  start = pathbench_now();
+  start_count = malloc_count;
+
+  for (long i = 0; i < lookups; i++)
+  {
+    snprintf(path, sizeof(path), "%s/f%ld", dir, i % PATHBENCH_FILES);
+    int inum = storage_path_parent_child(path, name);
+    assert(inum >= 0);
+  }
+
+  pathbench_report("parent/child", depth, lookups, start, start_count);
+
+  storage_deinit();
+  unlink(image_path);
+  return 0;
+}
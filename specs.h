@@ -1,18 +1,24 @@
 ///
 /// Holds specifications for the filesystem.
 ///
+/// Only the format-time defaults and the on-disk identification live here. The actual geometry of
+/// a mounted image (block size, block count, region locations) is read from the superblock.
+///
 
 #ifndef _H_SPECS
 #define _H_SPECS
 
-#define BLOCK_SIZE      4096 // 4KB block size
-#define BLOCK_COUNT     256  // Split the "disk" into 256 blocks
-#define RESERVED_BLOCKS 2    // 2 blocks of size 4KB are reserved for metadata (bitmaps and inodes)
-#define MAX_INODE_COUNT 254  // Maximum of 254 inodes allowed because this is all that will fit
+#define DEFAULT_BLOCK_SIZE 4096    // 4KB blocks unless another size is chosen at format time
+#define MIN_BLOCK_SIZE  1024       // Block sizes are powers of two between 1KB...
+#define MAX_BLOCK_SIZE  65536      // ...and 64KB
+#define SUPERBLOCK_BNUM 0          // The superblock always lives in the very first block
+#define NUFS_MAGIC      0x5346554e // "NUFS" in little endian, marks a formatted image
+#define NUFS_VERSION    14         // On-disk format version written by this build
+#define NUFS_OLDEST_VERSION 9      // Oldest on-disk format version that can be upgraded at mount
 
-#define NUFS_SIZE         (BLOCK_SIZE * BLOCK_COUNT)     // 1MB of total pseudo-disk size
-#define RESERVED_SIZE     (BLOCK_SIZE * RESERVED_BLOCKS) // 8192B are reserved (2 blocks)
-#define BLOCK_BITMAP_SIZE (BLOCK_COUNT / 8)              // 32B are used to hold the block bitmap
-#define INODE_BITMAP_SIZE (MAX_INODE_COUNT / 8)          // 32B are used to hold the inode bitmap
+#define DEFAULT_BLOCK_COUNT 256  // Images created implicitly at mount are 256 blocks (1MB)
+#define DEFAULT_INODE_RATIO 4096 // By default the inode table may grow to one inode per 4KB of space
+#define MIN_BLOCK_COUNT     32   // Smallest image that still leaves room for metadata, one inode
+                                 // group and data
 
 #endif
@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include "util.h"
 #include "specs.h"
@@ -11,7 +14,8 @@
 #include "block.h"
 #include "inode.h"
 #include "directory.h"
-#include "slist.h"
+#include "dindex.h"
+#include "dcache.h"
 #include "bitmap.h"
 #include "path.h"
 
@@ -19,36 +23,224 @@
 
 static inode_t *root_nodep;
 
-void storage_init(const char *host_path)
+// An open file or directory. The path is resolved once when it is opened, and every later request
+// made through the handle (FUSE passes it back in fi->fh) goes straight to the inode.
+typedef struct storage_handle
+{
+  int inum;                       // inode of the open file or directory
+  inode_t *nodep;                 // the inode itself, or NULL once a directory has been removed
+  off_t next_offset;              // where the last read or write through the handle ended
+  struct storage_handle *nextp;   // next open handle
+} storage_handle_t;
+
+static storage_handle_t *open_handles = NULL;
+
+int storage_format(const char *host_path, int block_count, int block_size, int inode_count)
 {
   assert(host_path);
 
-  // Create a memory map and initialize the disk blocks and.
-  block_init(host_path);
+  // By default the inode table may grow to one inode per DEFAULT_INODE_RATIO bytes of image space.
+  if (inode_count < 1)
+  {
+    inode_count = MAX(1, (int) ((long) block_count * block_size / DEFAULT_INODE_RATIO));
+  }
+
+  // Only the group descriptor table is sized for the maximum. The groups themselves are added as
+  // inodes run out, starting with a single one.
+  int group_max = (inode_count + INODE_GROUP_SIZE - 1) / INODE_GROUP_SIZE;
+
+  // Write the superblock, the empty block bitmap and the empty group descriptor table.
+  int rv = block_format(host_path, block_count, block_size, inode_gdt_size(group_max));
 
-  // Allocate the root inode and make it a directory if it doesn't already exist. Note that this
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Mount the fresh image so the first group and the root directory can be created. Note that this
   // relies on ROOT_INUM being 0. Otherwise, there is no guarantee ROOT_INUM will be allocated.
-  if (!inode_exists(ROOT_INUM))
+  rv = block_init(host_path);
+  assert(rv == 0);
+
+  // The directories of an image loaded earlier may have been mapped at the same addresses, so none
+  // of their cached entries can be trusted.
+  dcache_init();
+
+  if ((rv = inode_format(1, group_max)) < 0)
+  {
+    block_deinit();
+    return rv;
+  }
+
+  assert(inode_alloc() == ROOT_INUM);
+  rv = directory_init(ROOT_INUM);
+
+  // Ensure the root's .. points to itself.
+  if (rv == 0)
+  {
+    rv = directory_add_entry(ROOT_INUM, "..", ROOT_INUM, FALSE);
+  }
+
+  block_deinit();
+  return rv < 0 ? rv : 0;
+}
+
+void storage_init(const char *host_path)
+{
+  assert(host_path);
+
+  // Create a memory map of the disk blocks using the geometry in the superblock.
+  int rv = block_init(host_path);
+
+  // An empty image has never been formatted, so format it with the default geometry first.
+  if (rv == -ENODATA)
   {
-    assert(inode_alloc() == ROOT_INUM);
-    directory_init(ROOT_INUM);
+    rv = storage_format(host_path, DEFAULT_BLOCK_COUNT, DEFAULT_BLOCK_SIZE, 0);
+    assert(rv == 0);
+    rv = block_init(host_path);
   }
 
-  // Initialize a pointer to the root node structure and ensure it's .. points to itself.
+  // Refuse to mount anything that is not a valid image or whose inodes have a different layout.
+  if (rv < 0 || block_superblock()->inode_size != INODE_SIZE)
+  {
+    fprintf(stderr, "nufs: %s is not a valid nufs image (run mkfs.nufs)\n", host_path);
+    exit(1);
+  }
+
+  // Images from before the orphan list read back an empty head of 0, which is the root directory.
+  superblock_t *sbp = block_superblock();
+  int version = sbp->version;
+
+  if (version < 11)
+  {
+    sbp->orphan_inum = -1;
+  }
+
+  // Older images are valid as they are, but older builds don't know about unwritten extents, the
+  // orphan list, directory headers, their totals or internal inodes, so mark the image as the
+  // current version before any are used.
+  sbp->version = NUFS_VERSION;
+
+  // Start allocating inodes from the first group again, with nothing cached.
+  inode_init();
+  dcache_init();
+
+  // Nothing is open yet, so the files that were unlinked while open last time can go now, and so
+  // can the blocks reserved past the end of files that were being written when nufs was killed.
+  inode_free_orphans();
+  inode_trim_stale_prealloc();
+
+  // Images from before the index inodes were marked get them marked once.
+  if (version < 14)
+  {
+    dindex_mark_all();
+  }
+
+  // Images from before the directory totals get them added up once, which walks the whole tree.
+  if (version < 13 && directory_sum_tree(ROOT_INUM) < 0)
+  {
+    fprintf(stderr, "nufs: %s is too full to add up the directory totals\n", host_path);
+  }
+
+  // The root directory is created at format time.
+  assert(inode_exists(ROOT_INUM));
+
+  // Initialize a pointer to the root node structure.
   root_nodep = inode_get(ROOT_INUM);
-  directory_add_entry(ROOT_INUM, "..", ROOT_INUM, FALSE);
 }
 
 void storage_deinit(void)
 {
+  // Files unlinked while still open stay on the orphan list and are freed at the next mount. Their
+  // handles are forgotten along with the rest.
+  while (open_handles)
+  {
+    storage_handle_t *hp = open_handles;
+    open_handles = hp->nextp;
+    free(hp);
+  }
+
+  // Give back the blocks reserved past the end of files still being written.
+  inode_trim_all_prealloc();
+
   // Persist the blocks in the memory map to disk .
   block_deinit();
 }
 
 void storage_clear(void)
 {
-  // Clear all the blocks and reset the reserved blocks.
+  // Clear all the blocks and reset the reserved blocks. Every cached entry is gone with them.
   block_clear();
+  dcache_init();
+}
+
+int storage_grow(off_t size)
+{
+  superblock_t *sbp = block_superblock();
+
+  // The image is rounded down to a whole number of blocks, and block numbers must fit in an int.
+  off_t block_count = size >> BLOCK_SHIFT;
+
+  if (block_count <= sbp->block_count)
+  {
+    return -EINVAL;
+  }
+
+  if (block_count > INT_MAX)
+  {
+    return -EFBIG;
+  }
+
+  // Let the inode table grow along with the image, keeping the inodes per block it was formatted
+  // with.
+  int group_max = (int) (((int64_t) sbp->inode_group_max * block_count + sbp->block_count - 1)
+                         / sbp->block_count);
+  int rv = block_grow((int) block_count, inode_gdt_size(group_max));
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  sbp->inode_group_max = group_max;
+  return 0;
+}
+
+void storage_statfs(struct statvfs *stp)
+{
+  assert(stp);
+
+  superblock_t *sbp = block_superblock();
+  int free_inodes = 0;
+
+  for (int group_num = 0; group_num < sbp->inode_group_count; group_num++)
+  {
+    free_inodes += inode_group(group_num)->free_count;
+  }
+
+  // Groups that haven't been added yet count as free inodes, since they are added as needed.
+  memset(stp, 0, sizeof(struct statvfs));
+  stp->f_bsize = BLOCK_SIZE;
+  stp->f_frsize = BLOCK_SIZE;
+  stp->f_blocks = sbp->block_count;
+  stp->f_bfree = block_free_count();
+  stp->f_bavail = stp->f_bfree;
+  stp->f_files = (fsfilcnt_t) sbp->inode_group_max * INODE_GROUP_SIZE;
+  stp->f_ffree = stp->f_files - sbp->inode_count + free_inodes;
+  stp->f_favail = stp->f_ffree;
+  stp->f_namemax = MAX_DIR_ENTRY_NAME_LEN - 1;
+}
+
+void storage_get_stats(nufs_stats_t *statsp)
+{
+  assert(statsp);
+
+  dcache_stats_t dcache_stats = dcache_get_stats();
+
+  memset(statsp, 0, sizeof(nufs_stats_t));
+  statsp->dcache_hits = dcache_stats.hits;
+  statsp->dcache_negative_hits = dcache_stats.negative_hits;
+  statsp->dcache_misses = dcache_stats.misses;
 }
 
 int storage_inum_for_path(const char *path)
@@ -59,13 +251,13 @@ int storage_inum_for_path(const char *path)
   return inum_for_path_in(ROOT_INUM, path);
 }
 
-int storage_path_parent_child(const char *path, const char **child_namep)
+int storage_path_parent_child(const char *path, char *child_name)
 {
   assert(path);
-  assert(child_namep);
+  assert(child_name);
   
   // Start from the root.
-  return path_parent_child_in(ROOT_INUM, path, child_namep);
+  return path_parent_child_in(ROOT_INUM, path, child_name);
 }
 
 int storage_access(const char *path, int mode)
@@ -98,47 +290,234 @@ int storage_access(const char *path, int mode)
   return 0;
 }
 
-int storage_stat(const char *path, struct stat *stp)
+// Get the open handle with the given FUSE file handle.
+storage_handle_t *storage_handle(uint64_t fh)
 {
-  assert(path);
-  assert(stp);
+  storage_handle_t *hp = (storage_handle_t *) (uintptr_t) fh;
+  assert(hp);
+  assert(hp->nodep == inode_get(hp->inum));
+  return hp;
+}
 
-  // Lookup the inode inum at the given path.
-  int inum = storage_inum_for_path(path);
+// Add a handle for the given inode to the open list.
+int storage_handle_open(int inum, inode_t *nodep, uint64_t *fhp)
+{
+  storage_handle_t *hp = malloc(sizeof(storage_handle_t));
 
-  // If a lookup error occured return the error code.
-  if (inum < 0)
+  if (!hp)
   {
-    return inum;
+    return -ENOMEM;
   }
 
-  // Get a pointer to the inode.
-  inode_t *nodep = inode_get(inum);
+  hp->inum = inum;
+  hp->nodep = nodep;
+  hp->next_offset = 0;
+  hp->nextp = open_handles;
+  open_handles = hp;
+
+  *fhp = (uint64_t) (uintptr_t) hp;
+  return 0;
+}
+
+// Take the handle off the open list and free it.
+void storage_handle_close(storage_handle_t *hp)
+{
+  storage_handle_t **linkp = &open_handles;
+
+  while (*linkp != hp)
+  {
+    linkp = &(*linkp)->nextp;
+  }
+
+  *linkp = hp->nextp;
+  free(hp);
+}
+
+// Check whether any handle has the given inode open.
+bool_t storage_is_open(int inum)
+{
+  for (storage_handle_t *hp = open_handles; hp; hp = hp->nextp)
+  {
+    if (hp->inum == inum && hp->nodep)
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+// Count a file or symbolic link in the totals of the given directory and every directory above it.
+void storage_charge(inode_t *nodep, int parent_inum)
+{
+  inode_set_parent(nodep, parent_inum);
+  directory_account(inode_get(parent_inum), inode_total_size(nodep), 1, 0);
+}
+
+// Take a file or symbolic link back out of the totals it counts in, if any.
+void storage_uncharge(inode_t *nodep)
+{
+  int parent_inum = inode_get_parent(nodep);
+
+  if (parent_inum >= 0)
+  {
+    directory_account(inode_get(parent_inum), -inode_total_size(nodep), -1, 0);
+    inode_set_parent(nodep, -1);
+  }
+}
+
+// Add or take away a directory and everything below it to or from the totals of the given
+// directory and every directory above it.
+void storage_account_tree(inode_t *dnodep, int parent_inum, int sign)
+{
+  dirhdr_t *hdrp = directory_totals(dnodep);
+
+  if (hdrp)
+  {
+    directory_account(inode_get(parent_inum), sign * hdrp->tree_bytes, sign * hdrp->tree_files,
+                      sign * (hdrp->tree_dirs + 1));
+  }
+  else
+  {
+    directory_account(inode_get(parent_inum), 0, 0, sign);
+  }
+}
+
+// Add the change in size of a file since it was start_size to the totals it counts in.
+void storage_account_resize(inode_t *nodep, off_t start_size)
+{
+  off_t delta = inode_total_size(nodep) - start_size;
+
+  if (delta != 0 && !inode_is_dir(nodep) && inode_get_parent(nodep) >= 0)
+  {
+    directory_account(inode_get(inode_get_parent(nodep)), delta, 0, 0);
+  }
+}
 
+int storage_stat_node(int inum, inode_t *nodep, struct stat *stp)
+{
   // Set all used stats.
   stp->st_ino = inum;
   stp->st_blksize = BLOCK_SIZE;
   stp->st_size = inode_total_size(nodep);
-  stp->st_blocks = bytes_to_blocks(stp->st_size);
-  stp->st_mode = nodep->mode;
-  stp->st_nlink = nodep->refs;
+  stp->st_blocks = inode_get_sectors(nodep);
+  stp->st_mode = inode_get_mode(nodep);
+  stp->st_nlink = inode_get_refs(nodep);
+  stp->st_atim = inode_get_atime(nodep);
+  stp->st_mtim = inode_get_mtime(nodep);
+  stp->st_ctim = inode_get_ctime(nodep);
   
   // Unused stats set to default.
   stp->st_dev = 0;
   stp->st_rdev = 0;
   stp->st_gid = 0;
   stp->st_uid = 0;
-  stp->st_ctim.tv_sec = 0;
-  stp->st_ctim.tv_nsec = 0;
-  stp->st_mtim.tv_sec = 0;
-  stp->st_mtim.tv_nsec = 0;
-  stp->st_atim.tv_sec = 0;
-  stp->st_atim.tv_nsec = 0;
 
   // Return 0 indicating no error occured.
   return 0;
 }
 
+int storage_stat(const char *path, struct stat *stp)
+{
+  assert(path);
+  assert(stp);
+
+  // Lookup the inode inum at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  return storage_stat_node(inum, inode_get(inum), stp);
+}
+
+int storage_fstat(uint64_t fh, struct stat *stp)
+{
+  assert(stp);
+
+  // An open file can be stat'd even after it was unlinked.
+  storage_handle_t *hp = storage_handle(fh);
+  return storage_stat_node(hp->inum, hp->nodep, stp);
+}
+
+int storage_get_generation(uint64_t fh, unsigned int *generationp)
+{
+  assert(generationp);
+
+  // Directories and files both have handles, but a removed directory has no inode left.
+  storage_handle_t *hp = (storage_handle_t *) (uintptr_t) fh;
+  assert(hp);
+
+  if (!hp->nodep)
+  {
+    return -ENOENT;
+  }
+
+  *generationp = inode_get_generation(hp->nodep);
+  return 0;
+}
+
+int storage_chmod(const char *path, int mode)
+{
+  assert(path);
+
+  // Lookup the inode inum at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // Change the permission bits only. The type of the inode stays what it is.
+  inode_t *nodep = inode_get(inum);
+  inode_set_mode(nodep, (inode_get_mode(nodep) & S_IFMT) | (mode & ~S_IFMT));
+  inode_touch(nodep, INODE_CTIME);
+  return 0;
+}
+
+int storage_utimens(const char *path, const struct timespec ts[2])
+{
+  assert(path);
+  assert(ts);
+
+  // Lookup the inode inum at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // Each time is either given, UTIME_NOW to set it to the current time or UTIME_OMIT to leave it
+  // alone. Setting either one changes the inode, so the change time moves to now unless both are
+  // left alone.
+  inode_t *nodep = inode_get(inum);
+
+  if (ts[0].tv_nsec != UTIME_OMIT || ts[1].tv_nsec != UTIME_OMIT)
+  {
+    inode_touch(nodep, (ts[0].tv_nsec == UTIME_NOW ? INODE_ATIME : 0)
+                       | (ts[1].tv_nsec == UTIME_NOW ? INODE_MTIME : 0) | INODE_CTIME);
+  }
+
+  if (ts[0].tv_nsec != UTIME_NOW && ts[0].tv_nsec != UTIME_OMIT)
+  {
+    inode_set_atime(nodep, ts[0]);
+  }
+
+  if (ts[1].tv_nsec != UTIME_NOW && ts[1].tv_nsec != UTIME_OMIT)
+  {
+    inode_set_mtime(nodep, ts[1]);
+  }
+
+  return 0;
+}
+
 int storage_mknod(const char *path, int mode)
 {
   assert(path);
@@ -149,13 +528,14 @@ int storage_mknod(const char *path, int mode)
   // If the path already exists, return an error code.
   if (inum >= 0)
   {
-    return EEXIST;
+    return -EEXIST;
   }
 
-  // If a non-directory node was traversed in the path return this error code.
-  if (inum == -ENOTDIR)
+  // If a non-directory node was traversed in the path, or a name was too long, return this error
+  // code.
+  if (inum == -ENOTDIR || inum == -ENAMETOOLONG)
   {
-    return -ENOTDIR;
+    return inum;
   }
 
   // At this point we better be sure that the result was that it could not be found, otherwise a
@@ -168,8 +548,21 @@ int storage_mknod(const char *path, int mode)
   // the directory, whether or not it is canonical does not matter. We will just need to access its
   // inum so we can add an entry into the directory table.
 
-  // Allocate a new node.
-  inum = inode_alloc();
+  // Get the name of the child and the inum of the parent directory. The path didn't resolve, so
+  // the parent itself may be missing too.
+  char name[MAX_DIR_ENTRY_NAME_LEN];
+  int parent_inum = storage_path_parent_child(path, name);
+
+  if (parent_inum < 0)
+  {
+    return parent_inum;
+  }
+  
+  // It should be impossile at this point for the parent to not be a directory.
+  assert(inode_is_dir(inode_get(parent_inum)));
+
+  // Allocate a new node, preferably in the same inode group as its parent.
+  inum = inode_alloc_near(parent_inum);
 
   // If an error occured allocating the node, return the error.
   if (inum < 0)
@@ -179,36 +572,42 @@ int storage_mknod(const char *path, int mode)
 
   // Get the inode and update its mode.
   inode_t *nodep = inode_get(inum);
-  nodep->mode = mode;
+  inode_set_mode(nodep, mode);
 
   // If the node is a directory, initialize the directory in the node data.
-  if (mode & INODE_DIR)
+  int rv = inode_is_dir(nodep) ? directory_init(inum) : 0;
+
+  // Add the directory entry, along with the .. of a directory.
+  if (rv == 0)
   {
-    directory_init(inum);
+    rv = directory_add_entry(parent_inum, name, inum, TRUE);
   }
 
-  // Get the name of the child and the inum of the parent directory. We know the parent must exist
-  // since the inode at the whole path exists.
-  const char *name;
-  int parent_inum = storage_path_parent_child(path, &name);
-  
-  // It should be impossile at this point for the parent to not be a directory.
-  assert(inode_get(parent_inum)->mode & INODE_DIR);
-
-  // Add the directory entry and free the name buffer now that it has been copied.
-  int rv = directory_add_entry(parent_inum, name, inum, TRUE);
-  free((void *) name);
-
-  // Return any errors that may have occured attempting to add the directory entry. Ensure we free
-  // the inode we created.
+  // Return any errors that may have occured attempting to add the directory entries. Ensure we
+  // free the inode we created, and that the entry cache doesn't keep its . around.
   if (rv < 0)
   {
+    if (inode_is_dir(nodep))
+    {
+      directory_remove_entry(nodep, ".", FALSE);
+    }
+
     inode_free(inum);
     return rv;
   }
 
-  // Increase the ref counter and return success code 0.
-  nodep->refs++;
+  // Increase the ref counter and count the new node in the totals of the directories above it.
+  inode_add_refs(nodep, 1);
+
+  if (inode_is_dir(nodep))
+  {
+    directory_account(inode_get(parent_inum), 0, 0, 1);
+  }
+  else
+  {
+    storage_charge(nodep, parent_inum);
+  }
+
   return 0;
 }
 
@@ -234,40 +633,42 @@ int storage_link(const char *from, const char *to)
 
   // Get the name of the child and the inum of the parent directories. We already ensured the "from"
   // parent exists when we found the inode. The "to" parent may not, we must check.
-  const char *from_name, *to_name;
-  int from_parent_inum = storage_path_parent_child(from, &from_name);
-  int to_parent_inum = storage_path_parent_child(to, &to_name);
+  char from_name[MAX_DIR_ENTRY_NAME_LEN], to_name[MAX_DIR_ENTRY_NAME_LEN];
+  int from_parent_inum = storage_path_parent_child(from, from_name);
+  int to_parent_inum = storage_path_parent_child(to, to_name);
 
-  // Ensure the "to" parent was properly retrieved. If not, return the error.
-  if (to_parent_inum < 0)
+  // Ensure both parents were properly retrieved. If not, return the error. The "from" parent only
+  // has none if "from" is the root.
+  if (from_parent_inum < 0 || to_parent_inum < 0)
   {
-    // Be sure we still free the name strings.
-    free((void *) from_name);
-    free((void *) to_name);
-
-    return to_parent_inum;
+    return from_parent_inum < 0 ? from_parent_inum : to_parent_inum;
   }
 
   // It should be impossile at this point for either of the parents to not be a directory.
-  assert(inode_get(from_parent_inum)->mode & INODE_DIR);
-  assert(inode_get(to_parent_inum)->mode & INODE_DIR);
+  assert(inode_is_dir(inode_get(from_parent_inum)));
+  assert(inode_is_dir(inode_get(to_parent_inum)));
 
   // Add the directory entry. Hard links arent allowed for directories so we don't have to worry
   // about adding the .. (the last FALSE argument doesn't matter).
   int rv = directory_add_entry(to_parent_inum, to_name, inum, TRUE);
 
-  // Free the name strings.
-  free((void *) from_name);
-  free((void *) to_name);
-
   // If the entry failed to be added return its error code.
   if (rv < 0)
   {
     return rv;
   }
 
-  // Increase the ref counter and successfully return 0.
-  inode_get(inum)->refs++;
+  // Increase the ref counter and successfully return 0. A file already counts in the totals of the
+  // directory it was created in, but a directory brings its tree along.
+  inode_t *nodep = inode_get(inum);
+  inode_add_refs(nodep, 1);
+  inode_touch(nodep, INODE_CTIME);
+
+  if (inode_is_dir(nodep))
+  {
+    storage_account_tree(nodep, to_parent_inum, 1);
+  }
+
   return 0;
 }
 
@@ -286,18 +687,23 @@ int storage_unlink(const char *path)
 
   // Get the name of the child and the inum of the parent directory. We know the parent must exist
   // since the inode at the whole path exists.
-  const char *name;
-  int parent_inum = storage_path_parent_child(path, &name);
+  char name[MAX_DIR_ENTRY_NAME_LEN];
+  int parent_inum = storage_path_parent_child(path, name);
+
+  // The root has no parent to be removed from.
+  if (parent_inum < 0)
+  {
+    return parent_inum;
+  }
 
   inode_t *parent_node = inode_get(parent_inum);
   
   // It should be impossile at this point for the parent to not be a directory.
-  assert(parent_node->mode & INODE_DIR);
+  assert(inode_is_dir(parent_node));
 
   // Remove the directory entry. Hard links arent allowed for directories so we don't have to worry
   // about removing the .. (the last FALSE argument doesn't matter).
   int rv = directory_remove_entry(parent_node, name, TRUE);
-  free((void *) name);
 
   // Return any errors that may have occured attempting to remove the directory entry.
   if (rv < 0)
@@ -305,27 +711,139 @@ int storage_unlink(const char *path)
     return rv;
   }
 
+  // Once most of the directory is dead space, pack its entries back together. Not while it is being
+  // listed though, since moving the entries would make the listing skip or repeat some.
+  if (directory_needs_compact(parent_node) && !storage_is_open(parent_inum))
+  {
+    directory_compact(parent_node);
+  }
+
+  // Take the node out of the totals of the directories above once its last link is gone. A file
+  // that counts in this directory and has other links left counts in the root from now on, since
+  // its other directories aren't known.
+  inode_t *nodep = inode_get(inum);
+  bool_t uncharged = FALSE;
+
+  if (inode_is_dir(nodep))
+  {
+    storage_account_tree(nodep, parent_inum, -1);
+  }
+  else if (inode_get_parent(nodep) == parent_inum || inode_get_refs(nodep) == 1)
+  {
+    storage_uncharge(nodep);
+    uncharged = TRUE;
+  }
+
   // Decrease the ref counter.
-  int refs = --(inode_get(inum)->refs);
+  int refs = inode_add_refs(nodep, -1);
+  inode_touch(nodep, INODE_CTIME);
 
   // If the ref counter is at least 1, return successfully.
   if (refs > 0)
   {
+    if (uncharged)
+    {
+      storage_charge(nodep, ROOT_INUM);
+    }
+
     return 0;
   }
-  
-  // Free the inode since the ref count dropped below 1.
+
+  // A file that is still open lives on without a name until its last handle is released.
+  if (!inode_is_dir(nodep) && storage_is_open(inum))
+  {
+    inode_orphan_add(inum);
+    return 0;
+  }
+
+  // A directory that is still open just lists as empty from now on.
+  for (storage_handle_t *hp = open_handles; hp; hp = hp->nextp)
+  {
+    if (hp->nodep == nodep)
+    {
+      hp->nodep = NULL;
+    }
+  }
+
+  // Remove the directory's entry for itself too, so the entry cache doesn't hand it to whichever
+  // directory gets the inode next.
+  if (inode_is_dir(nodep))
+  {
+    directory_remove_entry(nodep, ".", FALSE);
+  }
+
+  // Free the inode since the ref count dropped below 1.
   rv = inode_free(inum);
 
   // If the inode could't be freed, return the error code.
   return rv < 0 ? rv : 0;
 }
 
+// Move a directory to a new name. Linking the new name and then unlinking the old one would leave
+// the directory with a .. for each parent in between, so instead its entry moves in one step and
+// its .. is pointed at the new parent.
+int storage_rename_dir(int inum, const char *from, const char *to)
+{
+  // Ensure the inode at the "to" path does not already exist.
+  if (storage_inum_for_path(to) >= 0)
+  {
+    return -EEXIST;
+  }
+
+  char from_name[MAX_DIR_ENTRY_NAME_LEN], to_name[MAX_DIR_ENTRY_NAME_LEN];
+  int from_parent_inum = storage_path_parent_child(from, from_name);
+  int to_parent_inum = storage_path_parent_child(to, to_name);
+
+  if (from_parent_inum < 0 || to_parent_inum < 0)
+  {
+    return from_parent_inum < 0 ? from_parent_inum : to_parent_inum;
+  }
+
+  inode_t *from_parent_node = inode_get(from_parent_inum);
+  inode_t *nodep = inode_get(inum);
+
+  int rv = directory_add_entry(to_parent_inum, to_name, inum, FALSE);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  rv = directory_remove_entry(from_parent_node, from_name, FALSE);
+
+  if (rv < 0)
+  {
+    directory_remove_entry(inode_get(to_parent_inum), to_name, FALSE);
+    return rv;
+  }
+
+  directory_set_parent(nodep, to_parent_inum);
+  inode_touch(nodep, INODE_CTIME);
+
+  // The tree moves from the totals of the old parent's line to those of the new one.
+  storage_account_tree(nodep, from_parent_inum, -1);
+  storage_account_tree(nodep, to_parent_inum, 1);
+
+  if (directory_needs_compact(from_parent_node) && !storage_is_open(from_parent_inum))
+  {
+    directory_compact(from_parent_node);
+  }
+
+  return 0;
+}
+
 int storage_rename(const char *from, const char *to)
 {
   assert(from);
   assert(to);
 
+  int inum = storage_inum_for_path(from);
+
+  if (inum >= 0 && inode_is_dir(inode_get(inum)))
+  {
+    return storage_rename_dir(inum, from, to);
+  }
+
   int rv = storage_link(from, to);
 
   if (rv < 0)
@@ -333,15 +851,31 @@ int storage_rename(const char *from, const char *to)
     return rv;
   }
 
+  // A file moves to the totals of its new directory. Take it out of the old ones before the old
+  // name goes, so unlinking doesn't move it to the root.
+  char name[MAX_DIR_ENTRY_NAME_LEN];
+  int to_parent_inum = storage_path_parent_child(to, name);
+  inode_t *nodep = inode_get(inum);
+  int charged_inum = inode_get_parent(nodep);
+
+  storage_uncharge(nodep);
+
   rv = storage_unlink(from);
 
   if (rv < 0)
   {
     // If we couldn't form the link we need to unlink the new one we already made.
     storage_unlink(to);
+
+    if (charged_inum >= 0)
+    {
+      storage_charge(nodep, charged_inum);
+    }
+
     return rv;
   }
 
+  storage_charge(nodep, to_parent_inum);
   return 0;
 }
 
@@ -362,7 +896,7 @@ int storage_rmdir(const char *dpath)
   inode_t *dnodep = inode_get(inum);
 
   // If the node is not a directory return an error code.
-  if (!(dnodep->mode & INODE_DIR))
+  if (!inode_is_dir(dnodep))
   {
     return -ENOTDIR;
   }
@@ -379,55 +913,74 @@ int storage_rmdir(const char *dpath)
 }
 
 
-int storage_truncate(const char *path, off_t size)
+int storage_truncate_node(inode_t *nodep, off_t size)
 {
-  assert(path);
-
   // If the given size is negative simply return 0.
   if (size < 0)
   {
     return 0;
   }
 
-  // Lookup the inode inum at the given path.
-  int inum = storage_inum_for_path(path);
-
-  // If a lookup error occured return the error code.
-  if (inum < 0)
-  {
-    return inum;
-  }
-
-  // Get a pointer to the inode and determine its current size.
-  inode_t *nodep = inode_get(inum);
-  int size_delta = size - inode_total_size(nodep);
+  // Determine the current size.
+  off_t start_size = inode_total_size(nodep);
+  off_t size_delta = size - start_size;
   int rv = 0;
 
-  // Grow the inode if the delta > 0.
+  // Grow the inode if the delta > 0. The new bytes are a hole, so this doesn't allocate anything.
   if (size_delta > 0)
   {
-    rv = inode_grow_zero(nodep, size_delta);
+    rv = inode_grow_sparse(nodep, size_delta);
   }
-  // Shrink the inode if the delta < 0.
-  else if (size_delta < 0)
+  // Shrink the inode if the delta <= 0. Truncating to the current size still frees any blocks that
+  // were preallocated past the end.
+  else
   {
     rv = inode_shrink(nodep, -size_delta);
   }
 
+  // A truncate usually leaves the file at its final size, so pack its last block right away.
+  if (rv == 0)
+  {
+    rv = inode_pack_tail(nodep);
+    inode_touch(nodep, INODE_MTIME | INODE_CTIME);
+  }
+
+  storage_account_resize(nodep, start_size);
+
   // Return either 0 or an error if one arose.
   return rv;
 }
 
-int storage_read_iter(void *buf, void *start, int offset, int size)
+int storage_truncate(const char *path, off_t size)
+{
+  assert(path);
+
+  // Lookup the inode inum at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  return storage_truncate_node(inode_get(inum), size);
+}
+
+int storage_ftruncate(uint64_t fh, off_t size)
+{
+  return storage_truncate_node(storage_handle(fh)->nodep, size);
+}
+
+int storage_read_iter(void *buf, void *start, off_t offset, int size)
 {
   char **strbufp = (char **) buf;
   memcpy(*strbufp + offset, start, size);
   return 0;
 }
 
-int storage_read(const char *path, char *buf, size_t size, off_t offset)
+int storage_read_node(inode_t *nodep, char *buf, size_t size, off_t offset)
 {
-  assert(path);
   assert(buf);
   
   // Only start reading if the size is a reasonable number.
@@ -436,6 +989,33 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset)
     return 0;
   }
 
+  // If the node is a directory return an error code.
+  if (inode_is_dir(nodep))
+  {
+    return -EISDIR;
+  }
+
+  // Reading at or past the end of the file reads nothing.
+  off_t total_size = inode_total_size(nodep);
+
+  if (offset >= total_size)
+  {
+    return 0;
+  }
+
+  // Determine the maximum number of readable bytes.
+  size = MIN(total_size - offset, (off_t) size);
+
+  // Write the blocks iteratively and return the written size.
+  inode_block_iter(nodep, &storage_read_iter, &buf, offset, size);
+  inode_touch_atime(nodep);
+  return size;
+}
+
+int storage_read(const char *path, char *buf, size_t size, off_t offset)
+{
+  assert(path);
+
   // Lookup the inode at the given path.
   int inum = storage_inum_for_path(path);
 
@@ -445,39 +1025,173 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset)
     return inum;
   }
 
-  // Get a pointer to the inode.
-  inode_t *nodep = inode_get(inum);
+  return storage_read_node(inode_get(inum), buf, size, offset);
+}
+
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+  storage_handle_t *hp = storage_handle(fh);
+  int rv = storage_read_node(hp->nodep, buf, size, offset);
+
+  if (rv > 0)
+  {
+    hp->next_offset = offset + rv;
+  }
+
+  return rv;
+}
+
+int storage_write_iter(void *buf, void *start, off_t offset, int size)
+{
+  // Copy the memory from the buffer into the block position.
+  memcpy(start, (const char *) buf + offset, size);
+  return 0;
+}
+
+// Write to the given inode. Sequential writes are the ones that continue where the previous write
+// through the same handle left off.
+int storage_write_node(inode_t *nodep, const char *buf, size_t size, off_t offset,
+                       bool_t sequential)
+{
+  assert(buf);
+
+  // Only start writing if the size is a reasonable number.
+  if (size < 1)
+  {
+    return 0;
+  }
 
   // If the node is a directory return an error code.
-  if (nodep->mode & INODE_DIR)
+  if (inode_is_dir(nodep))
   {
     return -EISDIR;
   }
 
-  // Determine the maximum number of readable bytes.
-  size = MIN(((size_t) inode_total_size(nodep) - offset), size);
+  // Grow the inode to fit the new bytes if needed. Anything between the old end and the offset is
+  // left as a hole.
+  off_t start_size = inode_total_size(nodep);
+  off_t growth_size = MAX(0, offset + (off_t) size - start_size);
+  int rv = inode_grow_sparse(nodep, growth_size);
+
+  // Return any error that may have occured.
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // A sequential write that extends the file from its end is most likely streaming, so reserve the
+  // space the next writes will need along with this one's.
+  if (sequential && growth_size > 0 && offset <= start_size)
+  {
+    inode_speculate(nodep, offset);
+  }
+
+  // Back the holes the write lands in with blocks. If space runs out, the blocks reserved for other
+  // files are taken back and the write tries again. If it still runs out part of the way, only the
+  // part that could be backed is written and the file ends there.
+  off_t mapped = inode_map_range(nodep, offset, size);
+
+  if (mapped < (off_t) size && inode_trim_all_prealloc())
+  {
+    mapped = inode_map_range(nodep, offset, size);
+  }
+
+  if (mapped < (off_t) size)
+  {
+    off_t end = mapped > 0 ? MAX(start_size, offset + mapped) : start_size;
+    inode_shrink(nodep, inode_total_size(nodep) - end);
+
+    if (mapped <= 0)
+    {
+      return mapped < 0 ? (int) mapped : -ENOSPC;
+    }
+  }
 
   // Write the blocks iteratively and return the written size.
-  inode_block_iter(nodep, &storage_read_iter, &buf, offset, size);
-  return size;
+  inode_block_iter(nodep, &storage_write_iter, (void *) buf, offset, mapped);
+  inode_touch(nodep, INODE_MTIME | INODE_CTIME);
+  storage_account_resize(nodep, start_size);
+  return mapped;
 }
 
-int storage_write_iter(void *buf, void *start, int offset, int size)
+int storage_write(const char *path, const char *buf, size_t size, off_t offset)
 {
-  // Copy the memory from the buffer into the block position.
-  memcpy(start, (const char *) buf, size);
+  assert(path);
+
+  // Lookup the inode at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // Without a handle there is no telling where the last write ended, so any write is taken to be
+  // sequential.
+  return storage_write_node(inode_get(inum), buf, size, offset, TRUE);
+}
+
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset)
+{
+  storage_handle_t *hp = storage_handle(fh);
+  int rv = storage_write_node(hp->nodep, buf, size, offset, offset == hp->next_offset);
+
+  if (rv > 0)
+  {
+    hp->next_offset = offset + rv;
+  }
+
+  return rv;
+}
+
+int storage_symlink(const char *target, const char *path)
+{
+  assert(target);
+  assert(path);
+
+  // The target has to fit in a path buffer when it is read back.
+  size_t size = strlen(target);
+
+  if (size >= PATH_MAX)
+  {
+    return -ENAMETOOLONG;
+  }
+
+  // Create the link like any other node.
+  int rv = storage_mknod(path, STORAGE_LINK | 0777);
+
+  if (rv < 0)
+  {
+    return rv;
+  }
+
+  // Store the target as the contents of the link. Targets that fit are kept inline, so following
+  // the link never has to fetch a block.
+  inode_t *nodep = inode_get(storage_inum_for_path(path));
+  rv = inode_grow(nodep, size);
+
+  // Don't leave a link with a missing target behind.
+  if (rv < 0)
+  {
+    storage_unlink(path);
+    return rv;
+  }
+
+  inode_block_iter(nodep, &storage_write_iter, (void *) target, 0, size);
+  storage_account_resize(nodep, 0);
   return 0;
 }
 
-int storage_write(const char *path, const char *buf, size_t size, off_t offset)
+int storage_readlink(const char *path, char *buf, size_t size)
 {
   assert(path);
   assert(buf);
 
-  // Only start writing if the size is a reasonable number.
+  // There must at least be room for the terminator.
   if (size < 1)
   {
-    return 0;
+    return -EINVAL;
   }
 
   // Lookup the inode at the given path.
@@ -489,34 +1203,259 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
     return inum;
   }
 
-  // Get a pointer to the inode.
+  // Get a pointer to the inode and ensure it is a link.
   inode_t *nodep = inode_get(inum);
 
-  // If the node is a directory return an error code.
-  if (nodep->mode & INODE_DIR)
+  if (!S_ISLNK(inode_get_mode(nodep)))
+  {
+    return -EINVAL;
+  }
+
+  // Copy as much of the target as fits, truncating it like readlink(2) does.
+  off_t length = MIN(inode_total_size(nodep), (off_t) size - 1);
+  const void *inline_data = inode_inline_data(nodep);
+
+  if (inline_data)
+  {
+    memcpy(buf, inline_data, length);
+  }
+  else
+  {
+    inode_block_iter(nodep, &storage_read_iter, &buf, 0, length);
+  }
+
+  buf[length] = '\0';
+  return 0;
+}
+
+int storage_punch_hole(uint64_t fh, off_t offset, off_t size)
+{
+  if (offset < 0 || size < 0)
+  {
+    return -EINVAL;
+  }
+
+  // Get the open inode and ensure it is a regular file.
+  inode_t *nodep = storage_handle(fh)->nodep;
+
+  if (!S_ISREG(inode_get_mode(nodep)))
+  {
+    return inode_is_dir(nodep) ? -EISDIR : -EINVAL;
+  }
+
+  // Free the blocks in the range, which then read back as zeroes. The size stays the same.
+  int rv = inode_punch(nodep, offset, size);
+
+  if (rv == 0)
+  {
+    inode_touch(nodep, INODE_MTIME | INODE_CTIME);
+  }
+
+  return rv;
+}
+
+int storage_fallocate(uint64_t fh, off_t offset, off_t size, int keep_size)
+{
+  if (offset < 0 || size < 1)
+  {
+    return -EINVAL;
+  }
+
+  // Get the open inode and ensure it is a regular file.
+  inode_t *nodep = storage_handle(fh)->nodep;
+
+  if (!S_ISREG(inode_get_mode(nodep)))
+  {
+    return inode_is_dir(nodep) ? -EISDIR : -ENODEV;
+  }
+
+  // Reserve blocks for the range without writing to them, so later writes can't run out of space.
+  // The contents only change if the file grows.
+  off_t start_size = inode_total_size(nodep);
+  int rv = inode_fallocate(nodep, offset, size, keep_size);
+
+  if (rv == 0)
+  {
+    inode_touch(nodep, INODE_CTIME | (inode_total_size(nodep) != start_size ? INODE_MTIME : 0));
+    storage_account_resize(nodep, start_size);
+  }
+
+  return rv;
+}
+
+int storage_zero_range(uint64_t fh, off_t offset, off_t size, int keep_size)
+{
+  if (offset < 0 || size < 1)
+  {
+    return -EINVAL;
+  }
+
+  // Get the open inode and ensure it is a regular file.
+  inode_t *nodep = storage_handle(fh)->nodep;
+
+  if (!S_ISREG(inode_get_mode(nodep)))
+  {
+    return inode_is_dir(nodep) ? -EISDIR : -ENODEV;
+  }
+
+  // Zero the range, keeping its blocks allocated unlike a punched hole.
+  off_t start_size = inode_total_size(nodep);
+  int rv = inode_zero_range(nodep, offset, size, keep_size);
+
+  if (rv == 0)
+  {
+    inode_touch(nodep, INODE_MTIME | INODE_CTIME);
+    storage_account_resize(nodep, start_size);
+  }
+
+  return rv;
+}
+
+int storage_open(const char *path, uint64_t *fhp)
+{
+  assert(path);
+  assert(fhp);
+
+  // Lookup the inode at the given path.
+  int inum = storage_inum_for_path(path);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // Directories are read through opendir instead.
+  inode_t *nodep = inode_get(inum);
+
+  if (inode_is_dir(nodep))
   {
     return -EISDIR;
   }
 
-  // Grow the inode to fit the new bytes if needed.
-  int growth_size = MAX(0, offset + size - inode_total_size(nodep));
-  int rv = inode_grow(nodep, growth_size);
+  // Add the handle to the open list, so unlinking the file knows to keep it around.
+  return storage_handle_open(inum, nodep, fhp);
+}
 
-  // Return any error that may have occured.
-  if (rv < 0)
+int storage_fsync(uint64_t fh)
+{
+  // Every file lives in the same memory map, so syncing one means syncing the whole image.
+  storage_handle(fh);
+  return block_sync();
+}
+
+int storage_release(uint64_t fh)
+{
+  storage_handle_t *hp = storage_handle(fh);
+  int inum = hp->inum;
+  inode_t *nodep = hp->nodep;
+
+  storage_handle_close(hp);
+
+  // Another handle may still be writing the file, so it is left alone until the last one goes.
+  if (storage_is_open(inum))
   {
-    return rv;
+    return 0;
   }
 
-  // Write the blocks iteratively and return the written size.
-  inode_block_iter(nodep, &storage_write_iter, (void *) buf, offset, size);
-  return size;
+  // The last handle on a file that was unlinked while open frees it.
+  if (inode_get_refs(nodep) == 0)
+  {
+    inode_orphan_remove(inum);
+    return inode_free(inum);
+  }
+
+  // The file is no longer being written through any handle, so the blocks reserved past its end
+  // are given back and its last partial block can be packed into fragments. Writing past it again
+  // later moves it back into a full block. The file is intact either way, so a tail that can't be
+  // packed doesn't fail the release.
+  int rv = inode_trim_prealloc(nodep);
+
+  if (rv == 0)
+  {
+    inode_pack_tail(nodep);
+  }
+
+  return rv;
 }
 
-int storage_list(const char *dpath, slist_t **namesp)
+int storage_opendir(const char *dpath, uint64_t *fhp)
+{
+  assert(dpath);
+  assert(fhp);
+
+  // Lookup the inode at the given path.
+  int inum = storage_inum_for_path(dpath);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // If the node is not a directory return an error code.
+  inode_t *dnodep = inode_get(inum);
+
+  if (!inode_is_dir(dnodep))
+  {
+    return -ENOTDIR;
+  }
+
+  // Add the handle to the open list, so the directory isn't compacted while it is being listed.
+  return storage_handle_open(inum, dnodep, fhp);
+}
+
+int storage_releasedir(uint64_t fh)
+{
+  storage_handle_t *hp = (storage_handle_t *) (uintptr_t) fh;
+  assert(hp);
+
+  storage_handle_close(hp);
+  return 0;
+}
+
+int storage_readdir_node(inode_t *dnodep, void *buf, storage_filler_t filler, off_t offset)
+{
+  assert(filler);
+
+  // The offset is the position of the next record to list, as handed to the filler along with the
+  // previous entry, or 0 to start from the beginning.
+  if (offset < 0 || offset > INT_MAX)
+  {
+    return -EINVAL;
+  }
+
+  // Listing a directory from the start reads it.
+  if (offset == 0)
+  {
+    inode_touch_atime(dnodep);
+  }
+
+  // Hand the entries to the filler straight from the directory blocks, along with their stats,
+  // which come straight from the inodes the entries refer to. Listing a directory takes a single
+  // pass over it, with no path lookups and nothing kept in memory between calls.
+  dirent_t *entryp;
+  struct stat st;
+  int pos = directory_seek(dnodep, (int) offset);
+
+  for (; (entryp = directory_next_entry(dnodep, &pos)); pos += DIRENT_REC_LEN(entryp))
+  {
+    memset(&st, 0, sizeof(st));
+    storage_stat_node(entryp->inum, inode_get(entryp->inum), &st);
+
+    // Stop once the filler's buffer is full. The next call resumes at this entry.
+    if (filler(buf, entryp->name, &st, pos + DIRENT_REC_LEN(entryp)))
+    {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+int storage_readdir(const char *dpath, void *buf, storage_filler_t filler, off_t offset)
 {
   assert(dpath);
-  assert(namesp);
 
   // Lookup the inode at the given path.
   int inum = storage_inum_for_path(dpath);
@@ -531,12 +1470,81 @@ int storage_list(const char *dpath, slist_t **namesp)
   inode_t *dnodep = inode_get(inum);
 
   // If the node is not a directory return an error code.
-  if (!(dnodep->mode & INODE_DIR))
+  if (!inode_is_dir(dnodep))
   {
     return -ENOTDIR;
   }
 
-  // Get the directory listing and return a success code of 0.
-  *namesp = directory_list(dnodep);
+  return storage_readdir_node(dnodep, buf, filler, offset);
+}
+
+int storage_readdir_fh(uint64_t fh, void *buf, storage_filler_t filler, off_t offset)
+{
+  storage_handle_t *hp = (storage_handle_t *) (uintptr_t) fh;
+  assert(hp);
+
+  // A directory removed while open has no entries left.
+  return hp->nodep ? storage_readdir_node(hp->nodep, buf, filler, offset) : 0;
+}
+
+int storage_get_usage(const char *dpath, nufs_usage_t *usagep)
+{
+  assert(dpath);
+  assert(usagep);
+
+  // Lookup the inode at the given path.
+  int inum = storage_inum_for_path(dpath);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // If the node is not a directory return an error code.
+  inode_t *dnodep = inode_get(inum);
+
+  if (!inode_is_dir(dnodep))
+  {
+    return -ENOTDIR;
+  }
+
+  // The totals are kept up to date in the directory header, so there is nothing to walk.
+  dirhdr_t *hdrp = directory_totals(dnodep);
+
+  if (!hdrp)
+  {
+    return -EIO;
+  }
+
+  usagep->bytes = hdrp->tree_bytes;
+  usagep->files = hdrp->tree_files;
+  usagep->dirs = hdrp->tree_dirs;
   return 0;
 }
+
+int storage_compact(const char *dpath)
+{
+  assert(dpath);
+
+  // Lookup the inode at the given path.
+  int inum = storage_inum_for_path(dpath);
+
+  // If a lookup error occured return the error code.
+  if (inum < 0)
+  {
+    return inum;
+  }
+
+  // If the node is not a directory return an error code.
+  inode_t *dnodep = inode_get(inum);
+
+  if (!inode_is_dir(dnodep))
+  {
+    return -ENOTDIR;
+  }
+
+  // Compacting on request doesn't wait for listings to finish, since the caller usually has the
+  // directory open itself to issue the request.
+  return directory_compact(dnodep);
+}
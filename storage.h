@@ -3,21 +3,36 @@
 #define _STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
+#include <stdint.h>
 #include <unistd.h>
-#include "slist.h"
+#include "control.h"
 
 #define STORAGE_FILE 0100000
 #define STORAGE_DIR  0040000
+#define STORAGE_LINK 0120000
 
+// Called with every entry of a directory being listed, in the shape of FUSE's fuse_fill_dir_t.
+// Returns nonzero once it has no room for more entries.
+typedef int (*storage_filler_t)(void *buf, const char *name, const struct stat *stp, off_t off);
+
+int storage_format(const char *host_path, int block_count, int block_size, int inode_count);
 void storage_init(const char *host_path);
 void storage_deinit(void);
 void storage_clear(void);
+int storage_grow(off_t size);
+void storage_get_stats(nufs_stats_t *statsp);
+void storage_statfs(struct statvfs *stp);
 int storage_inum_for_path(const char *path);
-int storage_path_parent_child(const char *path, const char **child_name);
+int storage_path_parent_child(const char *path, char *child_name);
 int storage_access(const char *path, int mode);
 int storage_stat(const char *path, struct stat *st);
+int storage_fstat(uint64_t fh, struct stat *st);
+int storage_get_generation(uint64_t fh, unsigned int *generationp);
+int storage_chmod(const char *path, int mode);
+int storage_utimens(const char *path, const struct timespec ts[2]);
 int storage_mknod(const char *path, int mode);
 int storage_link(const char *from, const char *to);
 int storage_unlink(const char *path);
@@ -26,6 +41,22 @@ int storage_rmdir(const char *dpath);
 int storage_truncate(const char *path, off_t size);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
-int storage_list(const char *dpath, slist_t **namesp);
+int storage_open(const char *path, uint64_t *fhp);
+int storage_ftruncate(uint64_t fh, off_t size);
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset);
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset);
+int storage_punch_hole(uint64_t fh, off_t offset, off_t size);
+int storage_fallocate(uint64_t fh, off_t offset, off_t size, int keep_size);
+int storage_zero_range(uint64_t fh, off_t offset, off_t size, int keep_size);
+int storage_fsync(uint64_t fh);
+int storage_release(uint64_t fh);
+int storage_symlink(const char *target, const char *path);
+int storage_readlink(const char *path, char *buf, size_t size);
+int storage_opendir(const char *dpath, uint64_t *fhp);
+int storage_releasedir(uint64_t fh);
+int storage_readdir(const char *dpath, void *buf, storage_filler_t filler, off_t offset);
+int storage_readdir_fh(uint64_t fh, void *buf, storage_filler_t filler, off_t offset);
+int storage_get_usage(const char *dpath, nufs_usage_t *usagep);
+int storage_compact(const char *dpath);
 
 #endif
@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 154;
 use IO::Handle;
 
 sub mount {
@@ -31,6 +31,55 @@ sub read_text {
     return $data;
 }
 
+# Returns the bytes held by the given file, including blocks reserved past its end. The kernel
+# keeps attributes for a second, so it waits for them to be fetched again first.
+sub allocated {
+    my ($name) = @_;
+    select(undef, undef, undef, 1.1);
+    return ((stat "mnt/$name")[12] // 0) * 512;
+}
+
+# Formats an image with the given block size, writes a large file and a small one in a directory,
+# and returns whether both read back after remounting along with the block size files report.
+sub block_size_round_trip {
+    my ($block_size) = @_;
+    system("rm -f data.nufs");
+    system("./mkfs.nufs -s 64M -b $block_size data.nufs > /dev/null");
+    mount();
+    my $large = "0123456789abcdef" x 20000;
+    write_text("large.txt", $large);
+    mkdir("mnt/sub");
+    write_text("sub/small.txt", "small");
+    unmount();
+    mount();
+    my $intact = (read_text("large.txt") eq $large and read_text("sub/small.txt") eq "small");
+    my $blksize = (stat "mnt/large.txt")[11] // 0;
+    unmount();
+    return ($intact, $blksize);
+}
+
+sub write_at {
+    my ($name, $data, $offset) = @_;
+    open my $fh, "+<", "mnt/$name" or return 0;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh or return 0;
+    return 1;
+}
+
+# Returns the block count of the mounted image and how many of the blocks are in use.
+sub block_counts {
+    my ($blocks, $free) = split " ", `stat -f -c "%b %f" mnt`;
+    return ($blocks, $blocks - $free);
+}
+
+# Returns the "bytes files directories" totals nufs keeps for the given directory.
+sub usage {
+    my ($name) = @_;
+    my %usage = `./nufsctl usage mnt/$name` =~ /^(\w+)\s+(\d+)$/mg;
+    return join " ", map { $usage{$_} // "?" } qw(bytes files directories);
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -171,5 +220,557 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+system("./mkfs.nufs -s 64M data.nufs > /dev/null");
+
+mount();
+
+say "# Speculative preallocation";
+
+open my $writer, ">", "mnt/stream";
+syswrite $writer, "s" x 65536 for 1 .. 16;
+ok(allocated("stream") > -s "mnt/stream", "An appending writer has blocks reserved past the end");
+open my $reader, "<", "mnt/stream";
+close $reader;
+ok(allocated("stream") > -s "mnt/stream", "Closing another handle keeps the reservation");
+close $writer;
+ok(allocated("stream") == -s "mnt/stream", "Closing the writer gives the reservation back");
+
+# Kill the instance while the file is still being written, so nothing gets trimmed on the way out.
+open $writer, ">>", "mnt/stream";
+syswrite $writer, "s" x 65536 for 1 .. 16;
+system("pkill -9 -x nufs; sleep 1");
+unmount();
+close $writer;
+mount();
+ok(allocated("stream") == -s "mnt/stream", "A killed instance leaves no reservation behind");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 64M data.nufs > /dev/null");
+
+mount();
+
+say "# Large directories";
+
+# Thousands of names spread the directory over many blocks, which gives it a hash index.
+mkdir("mnt/big");
+system("seq -f mnt/big/name%g 0 4999 | xargs touch");
+ok(-s "mnt/big" > 8 * 4096, "A directory of 5000 names spans several blocks");
+ok(`ls mnt/big | wc -l` == 5000, "List a directory of 5000 names");
+ok(`find mnt/big -type f | xargs stat -c %i | sort -u | wc -l` == 5000, "Stat every name");
+ok((-e "mnt/big/name0" and -e "mnt/big/name4999" and !-e "mnt/big/name5000"), "Look up names");
+
+unmount();
+mount();
+
+ok(`ls mnt/big | wc -l` == 5000, "List the directory again after remounting");
+ok((-e "mnt/big/name2500" and !-e "mnt/big/name-1"), "Look up names after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 4M data.nufs > /dev/null");
+
+mount();
+
+say "# Names of every length";
+
+# Records are as long as their names, so removing every other name leaves holes of every size for
+# the names created next.
+mkdir("mnt/names");
+my @names = map { chr(97 + $_ % 26) x $_ } 1 .. 255;
+my $created = 0;
+
+for my $name (@names) {
+    if (open my $name_fh, ">", "mnt/names/$name") {
+        close $name_fh;
+        $created++;
+    }
+}
+
+ok($created == 255, "Create names of 1 to 255 bytes");
+my @listed = sort split /\n/, `ls mnt/names`;
+ok("@listed" eq join(" ", sort @names), "List names of every length");
+
+unlink map { "mnt/names/$_" } grep { length($_) % 2 } @names;
+my @refilled = map { "z" x $_ } grep { $_ % 2 } 1 .. 255;
+system("touch", map { "mnt/names/$_" } @refilled);
+@listed = sort split /\n/, `ls mnt/names`;
+my @expected = sort((grep { length($_) % 2 == 0 } @names), @refilled);
+ok("@listed" eq "@expected", "Reuse the space of removed names");
+
+unmount();
+mount();
+
+@listed = sort split /\n/, `ls mnt/names`;
+ok("@listed" eq "@expected", "List names of every length after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 4M -i 300 data.nufs > /dev/null");
+
+mount();
+
+say "# Inode groups";
+
+# 300 inodes round up to two groups, so creating files fills the first group, adds the second and
+# stops once that one is full too.
+system("seq -f mnt/i%g 1 600 | xargs touch 2> /dev/null");
+my $inode_files = `ls mnt | wc -l`;
+chomp $inode_files;
+ok(($inode_files > 256 and $inode_files < 600), "Create files past the first inode group");
+
+unmount();
+mount();
+
+my $inode_files_again = `ls mnt | wc -l`;
+chomp $inode_files_again;
+ok($inode_files_again == $inode_files, "Keep the files of both groups after remounting");
+ok(!-e "mnt/i600", "Files past the last group were not created");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# Block sizes";
+
+my ($small_intact, $small_blksize) = block_size_round_trip("1K");
+ok($small_intact, "Read back files from an image of 1K blocks after remounting");
+ok($small_blksize == 1024, "Files on an image of 1K blocks report 1K blocks");
+
+my ($big_intact, $big_blksize) = block_size_round_trip("64K");
+ok($big_intact, "Read back files from an image of 64K blocks after remounting");
+ok($big_blksize == 65536, "Files on an image of 64K blocks report 64K blocks");
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 1M -i 4096 data.nufs > /dev/null");
+
+mount();
+
+say "# Full image";
+
+write_text("in.txt", "i" x 99);
+write_text("tt.txt", "t" x 7999);
+mkdir("mnt/full");
+system("seq -f mnt/full/f%g 0 1535 | xargs touch");
+
+# Every 300 byte file takes a whole block until it is closed and its tail packed into a fragment,
+# so once a write fails neither blocks nor fragments are left.
+for my $i (0 .. 1535) {
+    write_at("full/f$i", "z" x 300, 0) or last;
+}
+
+ok(truncate("mnt/tt.txt", 5000), "Shrink a file on a full image");
+ok(-s "mnt/tt.txt" == 5000, "The shrunk file has the new size");
+open my $tt_fh, "<", "mnt/tt.txt";
+ok(close($tt_fh), "Close a file on a full image");
+ok(!write_at("in.txt", "w" x 300, 0), "Growing an inline file past the inode fails");
+ok(read_text("in.txt") eq "i" x 99, "The inline file keeps its data");
+ok(truncate("mnt/in.txt", 118), "Grow an inline file after a failed write");
+ok(read_text_slice("in.txt", 18, 100) eq "\0" x 18, "The grown bytes read back as zeros");
+ok((!mkdir("mnt/nodir") and !-e "mnt/nodir"), "mkdir fails on a full image");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Symbolic links";
+
+write_text("target.txt", "linked");
+ok(symlink("target.txt", "mnt/link"), "Create a symbolic link");
+ok(readlink("mnt/link") eq "target.txt", "Read the symbolic link");
+ok(read_text("link") eq "linked", "Read through the symbolic link");
+
+# Targets too long for the inode go in a block instead.
+my $long_target = ("d" x 200 . "/") x 10 . "target.txt";
+ok(symlink($long_target, "mnt/long_link"), "Create a symbolic link with a long target");
+
+unmount();
+mount();
+
+ok(readlink("mnt/link") eq "target.txt", "Read the symbolic link after remounting");
+ok(readlink("mnt/long_link") eq $long_target, "Read the long target after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 4000K -b 1K data.nufs > /dev/null");
+
+mount();
+
+say "# Online grow";
+
+system("./nufsctl grow 20000K mnt");
+my ($blocks, $first_used) = block_counts();
+ok($blocks == 20000, "Grow the mounted image");
+
+for my $grow_size (80000, 300000, 1000000) {
+    system("./nufsctl grow ${grow_size}K mnt");
+}
+
+my $used;
+($blocks, $used) = block_counts();
+ok($blocks == 1000000, "Grow the mounted image again and again");
+
+# Only the current copies of the block bitmap, fragment map and group descriptors are in use.
+my $metadata = int(1000000 / 8192) + int(1000000 / 1024) + 64;
+say "# Used blocks: $first_used -> $used";
+ok($used - $first_used <= $metadata, "Growing leaves no old metadata behind");
+write_text("grown.txt", "g" x 100000);
+ok(-s "mnt/grown.txt" == 100001, "Write to the grown image");
+ok(system("./nufsctl grow 100K mnt 2> /dev/null") != 0, "Refuse to shrink the image");
+
+unmount();
+mount();
+
+($blocks) = block_counts();
+ok($blocks == 1000000, "Keep the grown size after remounting");
+ok(read_text("grown.txt") eq "g" x 100000, "Read back data written after growing");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Sparse files";
+
+system("truncate -s 1M mnt/holes");
+ok(-s "mnt/holes" == 1024 * 1024, "Extending truncate sets the size");
+ok(allocated("holes") == 0, "A file of holes takes no space");
+ok(read_text_slice("holes", 4096, 8192) eq "\0" x 4096, "A hole reads back as zeros");
+ok(write_at("holes", "x" x 10000, 500000), "Write into the middle of a hole");
+ok(read_text_slice("holes", 100, 499950) eq ("\0" x 50) . ("x" x 50), "Data after a hole");
+ok(read_text_slice("holes", 100, 509950) eq ("x" x 50) . ("\0" x 50), "Hole after data");
+ok(allocated("holes") < 64 * 1024, "Only the written blocks take space");
+ok(system("fallocate -p -o 500000 -l 8192 mnt/holes") == 0, "Punch a hole");
+ok(read_text_slice("holes", 8192, 500000) eq "\0" x 8192, "A punched hole reads back as zeros");
+ok(-s "mnt/holes" == 1024 * 1024, "Punching a hole keeps the size");
+
+unmount();
+mount();
+
+ok(read_text_slice("holes", 100, 509950) eq ("x" x 50) . ("\0" x 50), "Holes after remounting");
+
+unmount();
 
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 8M data.nufs > /dev/null");
+
+mount();
+
+say "# Preallocation";
+
+# Leave old data in the free blocks, which preallocated blocks must never show.
+write_text("garbage.txt", "q" x (3 * 1024 * 1024));
+unlink("mnt/garbage.txt");
+
+ok(system("fallocate -l 1M mnt/pre") == 0, "Preallocate a file");
+ok(-s "mnt/pre" == 1024 * 1024, "Preallocating sets the size");
+ok(allocated("pre") >= 1024 * 1024, "Preallocated blocks take space");
+ok(read_text_slice("pre", 8192, 500000) eq "\0" x 8192, "Preallocated blocks read back as zeros");
+ok(write_at("pre", "p" x 100, 4000), "Write into preallocated blocks");
+ok(read_text_slice("pre", 200, 3950) eq ("\0" x 50) . ("p" x 100) . ("\0" x 50),
+   "Preallocated blocks around written data read back as zeros");
+
+ok(system("fallocate -n -l 64K mnt/kept") == 0, "Preallocate past the end of a file");
+ok((-s "mnt/kept" == 0 and allocated("kept") >= 64 * 1024),
+   "Preallocating past the end keeps the size");
+
+write_text("zr.txt", "y" x 9999);
+ok(system("fallocate -z -o 100 -l 5000 mnt/zr.txt") == 0, "Zero a range");
+ok(read_text_slice("zr.txt", 5002, 99) eq "y" . ("\0" x 5000) . "y", "Zero only the range");
+ok(-s "mnt/zr.txt" == 10000, "Zeroing a range keeps the size");
+
+ok(system("fallocate -l 100M mnt/huge 2> /dev/null") != 0, "Preallocating more than is free fails");
+ok(((-s "mnt/huge" // 0) == 0 and allocated("huge") == 0), "A failed preallocation takes no space");
+
+unmount();
+mount();
+
+ok(read_text_slice("pre", 200, 3950) eq ("\0" x 50) . ("p" x 100) . ("\0" x 50),
+   "Preallocated blocks after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Path lookups after renames and unlinks";
+
+mkdir("mnt/ren");
+mkdir("mnt/ren/sub");
+write_text("ren/sub/a.txt", "first");
+ok(read_text("ren/sub/a.txt") eq "first", "Look up a nested file");
+ok(rename("mnt/ren/sub/a.txt", "mnt/ren/sub/b.txt"), "Rename a looked up file");
+ok((!-e "mnt/ren/sub/a.txt" and read_text("ren/sub/b.txt") eq "first"),
+   "Only the new name is found after a rename");
+ok(rename("mnt/ren/sub", "mnt/ren/moved"), "Rename the directory above it");
+ok((!-e "mnt/ren/sub/b.txt" and read_text("ren/moved/b.txt") eq "first"),
+   "Names below a renamed directory are found under its new name");
+ok(unlink("mnt/ren/moved/b.txt"), "Unlink a looked up file");
+ok(!-e "mnt/ren/moved/b.txt", "An unlinked file is not found");
+write_text("ren/moved/b.txt", "second");
+ok(read_text("ren/moved/b.txt") eq "second", "A file created in place of it is found");
+write_text("ren/moved/c.txt", "third");
+ok(rename("mnt/ren/moved/c.txt", "mnt/ren/moved/b.txt"), "Rename over a looked up file");
+ok(read_text("ren/moved/b.txt") eq "third", "The replacing file is found");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Lookups of missing names";
+
+mkdir("mnt/neg");
+my $missing_found = 0;
+
+for my $i (1 .. 20) {
+    $missing_found++ if -e "mnt/neg/missing.txt";
+}
+
+ok($missing_found == 0, "Repeated lookups of a missing name fail");
+my ($negative_hits) = `./nufsctl stats mnt` =~ /^dcache negative hits\s+(\d+)$/m;
+ok(($negative_hits // 0) > 0, "Repeated lookups of a missing name hit the cache");
+write_text("neg/missing.txt", "now here");
+ok(read_text("neg/missing.txt") eq "now here", "Create a name that was missing");
+ok((!-e "mnt/neg/dir" and mkdir("mnt/neg/dir") and -d "mnt/neg/dir"),
+   "Make a directory with a name that was missing");
+write_text("neg/src.txt", "renamed");
+ok((!-e "mnt/neg/dst.txt" and rename("mnt/neg/src.txt", "mnt/neg/dst.txt")
+    and read_text("neg/dst.txt") eq "renamed"), "Rename onto a name that was missing");
+ok(!-e "mnt/neg/src.txt", "The old name of a renamed file is missing");
+ok((!-e "mnt/neg/link" and symlink("dst.txt", "mnt/neg/link")
+    and read_text("neg/link") eq "renamed"), "Link a name that was missing");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Open unlinked files";
+
+write_text("target.txt", "linked");
+open my $open_fh, "+<", "mnt/target.txt";
+ok((unlink("mnt/target.txt") and !-e "mnt/target.txt"), "Unlink an open file");
+my $still = <$open_fh> // "";
+ok($still eq "linked\n", "Read an unlinked file through its open handle");
+seek $open_fh, 0, 2;
+print $open_fh "more";
+ok(close($open_fh), "Write to an unlinked file and close it");
+write_text("target.txt", "new");
+ok(read_text("target.txt") eq "new", "A new file can take the name of an unlinked open file");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Path errors";
+
+write_text("file.txt", "plain");
+my $long_name = "n" x 256;
+ok((!open(my $long_fh, ">", "mnt/$long_name") and $!{ENAMETOOLONG}),
+   "Creating a name longer than 255 bytes fails with ENAMETOOLONG");
+ok((!-e "mnt/$long_name/x" and $!{ENAMETOOLONG}),
+   "Looking up a path through a name longer than 255 bytes fails with ENAMETOOLONG");
+ok((!-e "mnt/file.txt/" and $!{ENOTDIR}), "A file with a trailing slash fails with ENOTDIR");
+ok((!-e "mnt/file.txt/x" and $!{ENOTDIR}), "A path through a file fails with ENOTDIR");
+ok((!mkdir("mnt/file.txt/x") and $!{ENOTDIR}), "Creating below a file fails with ENOTDIR");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 16M data.nufs > /dev/null");
+
+mount();
+
+say "# Listing while names are removed";
+
+# The listing takes many FUSE buffers, so it is resumed from an offset again and again while the
+# names at its end are removed.
+mkdir("mnt/stream");
+system("seq -f mnt/stream/f%g 0 2999 | xargs touch");
+opendir(my $stream_dh, "mnt/stream");
+my %seen;
+my $duplicates = 0;
+
+for (1 .. 100) {
+    my $entry = readdir($stream_dh) // last;
+    $duplicates++ if $seen{$entry}++;
+}
+
+unlink map { "mnt/stream/f$_" } 2000 .. 2999;
+
+while (defined(my $entry = readdir($stream_dh))) {
+    $duplicates++ if $seen{$entry}++;
+}
+
+closedir($stream_dh);
+ok($duplicates == 0, "No name is listed twice");
+ok(!grep({ !$seen{"f$_"} } 0 .. 1999), "Every name that was kept is listed");
+ok(`ls mnt/stream | wc -l` == 2000, "A new listing has only the names that were kept");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 16M data.nufs > /dev/null");
+
+mount();
+
+say "# Directory headers";
+
+# Whether a directory is empty comes from its count of live names, which has to survive remounts.
+mkdir("mnt/hdr");
+system("seq -f mnt/hdr/f%g 0 999 | xargs touch");
+unlink map { "mnt/hdr/f$_" } 1 .. 999;
+
+unmount();
+mount();
+
+ok((!rmdir("mnt/hdr") and -d "mnt/hdr"), "A directory with one name left is not empty");
+unlink("mnt/hdr/f0");
+
+unmount();
+mount();
+
+ok(rmdir("mnt/hdr"), "A directory whose last name was removed is empty");
+
+# New names go into the space of removed ones, found through the free space hints, instead of
+# making the directory larger.
+mkdir("mnt/reuse");
+system("seq -f mnt/reuse/f%g 0 999 | xargs touch");
+my $reuse_size = -s "mnt/reuse";
+unlink map { "mnt/reuse/f$_" } grep { $_ % 2 } 0 .. 999;
+
+unmount();
+mount();
+
+system("seq -f mnt/reuse/g%g 0 499 | xargs touch");
+ok(-s "mnt/reuse" <= $reuse_size, "New names reuse the space of removed ones after remounting");
+ok(`ls mnt/reuse | wc -l` == 1000, "List the reused directory");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+system("./mkfs.nufs -s 32M data.nufs > /dev/null");
+
+mount();
+
+say "# Directory compaction";
+
+# Removing most names compacts the directory right away.
+mkdir("mnt/churn");
+system("seq -f mnt/churn/f%g 0 4999 | xargs touch");
+my $churn_size = -s "mnt/churn";
+unlink map { "mnt/churn/f$_" } 100 .. 4999;
+ok(-s "mnt/churn" < $churn_size / 4, "Removing most names shrinks the directory");
+ok(`ls mnt/churn | wc -l` == 100, "List the compacted directory");
+ok(`find mnt/churn -type f | xargs stat -c %i | sort -u | wc -l` == 100,
+   "Stat every name of the compacted directory");
+
+# A directory that is being listed is left alone until it is compacted explicitly.
+mkdir("mnt/held");
+system("seq -f mnt/held/f%g 0 4999 | xargs touch");
+my $held_size = -s "mnt/held";
+opendir(my $held_dh, "mnt/held");
+unlink map { "mnt/held/f$_" } 100 .. 4999;
+my $open_size = -s "mnt/held";
+closedir($held_dh);
+ok($open_size == $held_size, "A directory being listed is not compacted");
+my $compacted = `./nufsctl compact mnt/held`;
+ok(($compacted =~ /^(\d+) blocks freed/ and $1 > 0), "Compact a directory explicitly");
+ok(allocated("held") < $held_size / 4, "Compacting shrinks the directory");
+ok((-e "mnt/held/f0" and -e "mnt/held/f99" and !-e "mnt/held/f100"),
+   "Look up names after compacting");
+
+unmount();
+mount();
+
+ok((`ls mnt/churn | wc -l` == 100 and `ls mnt/held | wc -l` == 100),
+   "List the compacted directories after remounting");
+ok(`find mnt/held -type f | xargs stat -c %i | sort -u | wc -l` == 100,
+   "Stat every name after remounting");
+system("seq -f mnt/held/g%g 0 999 | xargs touch");
+ok(`ls mnt/held | wc -l` == 1100, "Add names to a compacted directory");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Permissions and timestamps";
+
+write_text("times.txt", "tick");
+ok(chmod(0600, "mnt/times.txt"), "Change the permissions of a file");
+ok(((stat "mnt/times.txt")[2] & 07777) == 0600, "stat reports the new permissions");
+
+my $first = `date -d "2001-02-03 04:05:06" +%s`;
+my $second = `date -d "2002-03-04 05:06:07" +%s`;
+my $third = `date -d "2003-04-05 06:07:08" +%s`;
+chomp($first, $second, $third);
+system("touch -d '2001-02-03 04:05:06' mnt/times.txt");
+my ($atime, $mtime) = (stat "mnt/times.txt")[8, 9];
+ok(($atime == $first and $mtime == $first), "touch -d sets both times");
+system("touch -m -d '2002-03-04 05:06:07' mnt/times.txt");
+($atime, $mtime) = (stat "mnt/times.txt")[8, 9];
+ok(($atime == $first and $mtime == $second), "touch -m sets only the modification time");
+system("touch -a -d '2003-04-05 06:07:08' mnt/times.txt");
+($atime, $mtime) = (stat "mnt/times.txt")[8, 9];
+ok(($atime == $third and $mtime == $second), "touch -a sets only the access time");
+
+unmount();
+mount();
+
+my ($mode, $atime_again, $mtime_again) = (stat "mnt/times.txt")[2, 8, 9];
+ok((($mode & 07777) == 0600 and $atime_again == $third and $mtime_again == $second),
+   "Keep the permissions and times after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Usage totals";
+
+ok((mkdir("mnt/ua") and mkdir("mnt/ua/sub") and mkdir("mnt/ub")), "Create directories");
+write_text("ua/sub/f", "y" x 999);
+ok(usage("ua") eq "1000 1 1", "Totals count the file and directory below");
+system("mv mnt/ua/sub mnt/ub/");
+ok(usage("ua") eq "0 0 0", "Totals move out with a renamed directory");
+ok(usage("ub") eq "1000 1 1", "Totals move in with a renamed directory");
+system("mv mnt/ub/sub/f mnt/ua/");
+ok((usage("ub") eq "0 0 1" and usage("ua") eq "1000 1 0"), "Totals follow a renamed file");
+ok(usage("") =~ /^\d+ \d+ 3$/, "The root counts every directory");
+
+unmount();
+mount();
+
+ok((usage("ua") eq "1000 1 0" and usage("ub") eq "0 0 1"), "Keep the totals after remounting");
+
+unmount();
+
+system("rm -f data.nufs test.log");
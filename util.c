@@ -2,7 +2,9 @@
 /// General utilities
 ///
 
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 void repeat_print(const char *str, size_t n)
 {
@@ -11,3 +13,31 @@ void repeat_print(const char *str, size_t n)
     printf("%s", str);
   }
 }
+
+// Parse a size string such as "512M" or "4G" into bytes. Returns -1 if the string is malformed.
+long long parse_size(const char *str)
+{
+  assert(str);
+
+  char *end;
+  long long size = strtoll(str, &end, 10);
+
+  if (end == str || size < 0)
+  {
+    return -1;
+  }
+
+  // Apply the (case insensitive) binary suffix if one is present.
+  switch (*end)
+  {
+  case 'T': case 't': size <<= 10; // fall through
+  case 'G': case 'g': size <<= 10; // fall through
+  case 'M': case 'm': size <<= 10; // fall through
+  case 'K': case 'k': size <<= 10; end++; break;
+  case '\0': break;
+  default: return -1;
+  }
+
+  // Nothing is allowed to follow the suffix.
+  return *end == '\0' ? size : -1;
+}
@@ -15,5 +15,6 @@ typedef unsigned char byte_t;
 typedef char bool_t;
 
 void repeat_print(const char *str, size_t n);
+long long parse_size(const char *str);
 
 #endif
\ No newline at end of file